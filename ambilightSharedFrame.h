@@ -0,0 +1,186 @@
+// ambilightSharedFrame.h : Shared-memory frame ingestion API.
+//
+// Lets other processes on the same machine (media players, game capture tools) hand frames directly to the
+// ambilight client, instead of it grabbing the screen. The producer creates a named file mapping holding a
+// header and a small ring of frame slots, and renders/decodes straight into a slot. The client reads only
+// the border bands it needs straight from the mapping, so neither side copies a full frame.
+//
+// Producer usage:
+//    ambilightSharedFrameProducer producer;
+//    ambilightSharedFrameCreate(&producer, AMBILIGHT_SHARED_FRAME_DEFAULT_NAME, width, height, AMBILIGHT_SHARED_FRAME_FORMAT_BGRA32, FALSE);
+//    for each frame:
+//       BYTE* slot = ambilightSharedFrameBeginWrite(&producer);
+//       ... write width x height pixels into slot, producer.header->stride bytes per line ...
+//       ambilightSharedFrameEndWrite(&producer);
+//    ambilightSharedFrameDestroy(&producer);
+//
+// Every slot is guarded by a sequence counter (odd while the producer writes it). A reader takes the counter
+// before and after reading, and drops what it read if the counter changed in between.
+//
+// A restarted producer reuses the mapping if the reader still holds it open, as long as it asks for the same size.
+// It bumps the generation, so the reader takes the new header again.
+//
+
+#pragma once
+
+#include <windows.h>
+
+///////////////////////////////////////////////////////////////////////////////////
+// Defines
+///////////////////////////////////////////////////////////////////////////////////
+
+#define AMBILIGHT_SHARED_FRAME_DEFAULT_NAME L"Local\\AmbilightFrames"
+#define AMBILIGHT_SHARED_FRAME_MAGIC        (0x4D524641) // 'AFRM'
+#define AMBILIGHT_SHARED_FRAME_VERSION      (2)
+#define AMBILIGHT_SHARED_FRAME_NUM_SLOTS    (3) // The producer never writes the slot of the latest frame
+
+#define AMBILIGHT_SHARED_FRAME_FORMAT_BGRA32 (1) // Same as a 32bpp windows bitmap, alpha is ignored
+
+///////////////////////////////////////////////////////////////////////////////////
+// Types
+///////////////////////////////////////////////////////////////////////////////////
+
+typedef struct ambilightSharedFrameHeader {
+   UINT32 magic;
+   UINT32 version;
+   UINT32 headerSize;   // Offset of the first slot from the start of the mapping
+   UINT32 format;       // AMBILIGHT_SHARED_FRAME_FORMAT_xxx
+   UINT32 width;
+   UINT32 height;
+   UINT32 stride;       // Bytes between the start of two lines
+   UINT32 isBottomUp;   // Line 0 is the bottom line of the frame (windows DIB order)
+   UINT32 numSlots;
+   UINT32 slotSize;     // Bytes between the start of two slots
+   volatile LONG generation;                                      // Incremented every time a producer (re)creates the frames
+   volatile LONG64 latestFrame;                                   // Number of the last completed frame, 0 - none yet
+   volatile LONG64 slotSequence[AMBILIGHT_SHARED_FRAME_NUM_SLOTS]; // Odd while the slot is being written
+} ambilightSharedFrameHeader;
+
+typedef struct ambilightSharedFrameProducer {
+   HANDLE hMapping;
+   ambilightSharedFrameHeader* header;
+   BYTE* slots;
+   LONG64 writingFrame;
+} ambilightSharedFrameProducer;
+
+///////////////////////////////////////////////////////////////////////////////////
+// Functions
+///////////////////////////////////////////////////////////////////////////////////
+
+// Slot that holds (or will hold) the given frame number
+static inline UINT32 ambilightSharedFrameSlot(const ambilightSharedFrameHeader* header, LONG64 frame)
+{
+   return (UINT32)(frame % header->numSlots);
+}
+
+static inline BOOL ambilightSharedFrameCreate(ambilightSharedFrameProducer* producer, const wchar_t* name, UINT32 width, UINT32 height, UINT32 format, BOOL isBottomUp)
+{
+   UINT32 headerSize = (sizeof(ambilightSharedFrameHeader) + 63) & ~63; // Cache line aligned slots
+   UINT32 stride = width * 4;
+   UINT32 slotSize = ((stride * height) + 63) & ~63;
+   ULONGLONG mappingSize = headerSize + (ULONGLONG)slotSize * AMBILIGHT_SHARED_FRAME_NUM_SLOTS;
+
+   producer->hMapping = CreateFileMapping(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, (DWORD)(mappingSize >> 32), (DWORD)mappingSize, name);
+   if (producer->hMapping == NULL)
+   {
+      return FALSE;
+   }
+
+   BOOL isExisting = (GetLastError() == ERROR_ALREADY_EXISTS);
+
+   producer->header = (ambilightSharedFrameHeader*)MapViewOfFile(producer->hMapping, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+   if (producer->header == NULL)
+   {
+      CloseHandle(producer->hMapping);
+      producer->hMapping = NULL;
+      return FALSE;
+   }
+
+   if (isExisting)
+   {
+      // Still held open by a reader (e.g. the producer was restarted), its size can't change anymore
+      MEMORY_BASIC_INFORMATION viewInfo;
+      SYSTEM_INFO systemInfo;
+
+      GetSystemInfo(&systemInfo);
+      ULONGLONG pageMask = (ULONGLONG)systemInfo.dwPageSize - 1;
+      if ((VirtualQuery(producer->header, &viewInfo, sizeof(viewInfo)) == 0)
+         || ((ULONGLONG)viewInfo.RegionSize != ((mappingSize + pageMask) & ~pageMask)))
+      {
+         UnmapViewOfFile(producer->header);
+         producer->header = NULL;
+         CloseHandle(producer->hMapping);
+         producer->hMapping = NULL;
+         return FALSE;
+      }
+
+      // Readers drop the old header before it is rewritten
+      producer->header->magic = 0;
+      InterlockedIncrement(&producer->header->generation);
+      producer->header->latestFrame = 0;
+      for (UINT32 slot = 0; slot < AMBILIGHT_SHARED_FRAME_NUM_SLOTS; slot++)
+      {
+         if (producer->header->slotSequence[slot] & 1)
+            InterlockedIncrement64(&producer->header->slotSequence[slot]); // The old producer stopped in the middle of a frame
+      }
+   }
+   else
+   {
+      // A new mapping is zeroed, so every slot starts as a black frame
+      InterlockedIncrement(&producer->header->generation);
+   }
+
+   producer->header->version = AMBILIGHT_SHARED_FRAME_VERSION;
+   producer->header->headerSize = headerSize;
+   producer->header->format = format;
+   producer->header->width = width;
+   producer->header->height = height;
+   producer->header->stride = stride;
+   producer->header->isBottomUp = isBottomUp;
+   producer->header->numSlots = AMBILIGHT_SHARED_FRAME_NUM_SLOTS;
+   producer->header->slotSize = slotSize;
+   MemoryBarrier();
+   producer->header->magic = AMBILIGHT_SHARED_FRAME_MAGIC; // Written last, readers check it first
+
+   producer->slots = (BYTE*)producer->header + headerSize;
+   producer->writingFrame = 0;
+   return TRUE;
+}
+
+// Returns the slot to write the next frame into
+static inline BYTE* ambilightSharedFrameBeginWrite(ambilightSharedFrameProducer* producer)
+{
+   ambilightSharedFrameHeader* header = producer->header;
+   UINT32 slot;
+
+   producer->writingFrame = header->latestFrame + 1;
+   slot = ambilightSharedFrameSlot(header, producer->writingFrame);
+
+   InterlockedIncrement64(&header->slotSequence[slot]); // Odd - readers of this slot will drop what they read
+   return producer->slots + (ULONGLONG)slot * header->slotSize;
+}
+
+// Publishes the frame written since ambilightSharedFrameBeginWrite()
+static inline void ambilightSharedFrameEndWrite(ambilightSharedFrameProducer* producer)
+{
+   ambilightSharedFrameHeader* header = producer->header;
+   UINT32 slot = ambilightSharedFrameSlot(header, producer->writingFrame);
+
+   InterlockedIncrement64(&header->slotSequence[slot]); // Even - stable again
+   InterlockedExchange64(&header->latestFrame, producer->writingFrame);
+}
+
+static inline void ambilightSharedFrameDestroy(ambilightSharedFrameProducer* producer)
+{
+   if (producer->header != NULL)
+   {
+      UnmapViewOfFile(producer->header);
+      producer->header = NULL;
+   }
+
+   if (producer->hMapping != NULL)
+   {
+      CloseHandle(producer->hMapping);
+      producer->hMapping = NULL;
+   }
+}
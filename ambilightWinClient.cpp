@@ -3,8 +3,20 @@
 
 #include "stdafx.h"
 #include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <winsock2.h> // Must be included before windows.h
+#include <ws2tcpip.h>
 #include <windows.h>
 #include <chrono> //For time measurements
+#include "ambilightSharedFrame.h"
+
+#pragma comment(lib, "Ws2_32.lib")
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#define USE_SSE2
+#include <emmintrin.h> //SSE2 intrinsics
+#endif
 
 //#define SAVE_BITMAP_TO_CLIPBOARD
 
@@ -17,6 +29,12 @@
 
 #define NUM_VALUES_PER_WIN_PIXEL   (4)
 
+#define DDP_DEFAULT_PORT (4048)
+
+#define LED_RECORDING_MAGIC     (0x43524C41) // 'ALRC'
+#define LED_RECORDING_VERSION   (1)
+#define LED_RECORDING_KEY_FRAME (0x0001)     // The payload is the whole frame, otherwise a delta to the previous frame of the device
+
 ///////////////////////////////////////////////////////////////////////////////////
 // Globals
 ///////////////////////////////////////////////////////////////////////////////////
@@ -26,20 +44,77 @@ BOOL gExitProgram = FALSE;
 const unsigned int gEdgeDetectionCheckIntervalSec = 5;
 const BOOL edgeDetection_enable = TRUE;
 
+// Adaptive capture rate - capturing slows down while the LED colors don't change, and catches up on the first change
+const BOOL adaptiveCaptureRate_enable = TRUE;
+const unsigned int gCaptureFpsActive = 60;
+const unsigned int gCaptureFpsStatic = 10;    // No change for gStaticDelayMsec
+const unsigned int gCaptureFpsIdle = 2;       // No change for gIdleDelayMsec, or black for gStaticDelayMsec
+const unsigned int gStaticDelayMsec = 1000;
+const unsigned int gIdleDelayMsec = 10000;
+const unsigned int gStaticColorThreshold = 2; // Max change of a LED color value still counted as static (dithering noise)
+const unsigned int gBlackColorThreshold = 2;  // Max LED color value still counted as black
+
+// Color processing
+const BOOL linearLightAveraging_enable = FALSE; // Average screen zones in linear light instead of raw sRGB values
+const BOOL fixedLedKernels_enable = TRUE;       // Use the compile-time specialized kernel of a layout, when there is one (gFixedLedKernels)
+
+// Output devices
+enum ledTransportType {
+   TRANSPORT_SERIAL,
+   TRANSPORT_UDP,
+};
+
+struct ledDeviceConfig {
+   const char *name;
+   ledTransportType transport;
+   const wchar_t *portName; // Serial transport
+   const char *host;        // UDP transport
+   unsigned int port;       // UDP transport
+   unsigned int numHorisontal, numVertical;
+   float cropLeft, cropTop, cropRight, cropBottom; // Part of the detected screen area lit by the device, [0..1]
+};
+
+// All devices are fed from a single screen capture, devices with the same layout and crop region share their reduction
+const ledDeviceConfig gLedDeviceConfigs[] = {
+   // name      transport         serial port      UDP host, port  layout    crop region (left, top, right, bottom)
+   { "main",    TRANSPORT_SERIAL, L"\\\\.\\COM1", NULL, 0,        28, 16,   0.0f, 0.0f, 1.0f, 1.0f },
+   // Example - bias light behind a soundbar, lit by the bottom center of the screen:
+   //{ "soundbar", TRANSPORT_SERIAL, L"\\\\.\\COM2", NULL, 0, 20, 2, 0.25f, 0.8f, 0.75f, 1.0f },
+   // Example - ESP based controller (e.g. WLED) over the network:
+   //{ "esp",     TRANSPORT_UDP,    NULL, "192.168.1.50", DDP_DEFAULT_PORT, 28, 16, 0.0f, 0.0f, 1.0f, 1.0f },
+};
+const unsigned int gNumLedDevices = sizeof(gLedDeviceConfigs) / sizeof(gLedDeviceConfigs[0]);
+
+// Statistics
+const unsigned int gStatsIntervalFrames = 300; // Print capture statistics every N frames
+const unsigned int gStatsIntervalMaxSec = 30;  // ... or at least this often, when capturing at a low rate
+
 ///////////////////////////////////////////////////////////////////////////////////
 // Classes
 ///////////////////////////////////////////////////////////////////////////////////
 
-class serialCon {
+// Output transport of a single LED device
+class ledTransport {
+public:
+   virtual ~ledTransport() {}
+
+   virtual BOOL isConnected() = 0;
+   virtual BOOL connect() = 0;
+   virtual void closeConnection() = 0;
+   virtual void send(BYTE *finalPixels, int numPixels) = 0;
+};
+
+class serialCon : public ledTransport {
 private:
    HANDLE hSerial;
    BOOL isSerialConnected;
-   wchar_t *portName = L"\\\\.\\COM1";
+   const wchar_t *portName;
 
 public:
-   serialCon() {
+   serialCon(const wchar_t *portName) {
       hSerial = INVALID_HANDLE_VALUE;
       isSerialConnected = FALSE;
+      this->portName = portName;
    }
 
    ~serialCon() { 
@@ -47,6 +122,7 @@ public:
    }
    
    BOOL isConnected(){ return isSerialConnected; };
+   BOOL connect() { return setupSerialComm(); }
    void closeConnection() 
    { 
       if (hSerial != INVALID_HANDLE_VALUE)
@@ -56,51 +132,110 @@ public:
          isSerialConnected = FALSE;
       }
    };
+   void send(BYTE *finalPixels, int numPixels) { sendToArduino(finalPixels, numPixels); }
 
    BOOL setupSerialComm();
    void sendToArduino(BYTE *finalPixels, int numPixels);
 };
 
-class leds {
+// Network transport, sends LED frames as UDP packets in the DDP (Distributed Display Protocol) format,
+// which is understood by most ESP based LED controllers. There is no ACK, so sending never waits for the controller.
+// A frame that doesn't fit a single packet is split to several packets (the DDP equivalent of universes) and only
+// the last one carries the push flag, so the controller shows the whole frame at once.
+class udpCon : public ledTransport {
 private:
-   serialCon serialConnection;
-   float brightnessCoef;
-   BOOL isReady;
-   
+   static const unsigned int ddpHeaderSize = 10;
+   static const unsigned int ddpMaxDataSize = 1440; // 480 RGB pixels, keeps the packets below the Ethernet MTU
+   static const unsigned int ddpPacketSize = ddpHeaderSize + ddpMaxDataSize;
+
+   SOCKET hSocket;
+   BOOL isUdpConnected;
+   BOOL isSegmentationOffload; // A single send() is split by the OS into all the packets of a frame
+   const char *host;
+   unsigned int port;
+   BYTE* packetBuffer; // All packets of a frame back to back, allocated once
+   unsigned int maxNumBytesPerFrame;
+   BYTE sequence;
+
+public:
+   udpCon(const char *host, unsigned int port, unsigned int maxNumBytesPerFrame);
+   ~udpCon();
+
+   BOOL isConnected() { return isUdpConnected; }
+   BOOL connect();
+   void closeConnection();
+   void send(BYTE *finalPixels, int numPixels);
+};
+
+// LEDs layout around the screen area of a single device
+class ledLayout {
 public:
-   //LEDs layout
-   static const unsigned int numHorisontal = 28;
-   static const unsigned int numVertical = 16;
    static const unsigned int numValuesPerPixel = 3; //LS2802b parameters
-   static const unsigned int totalAmountOfLeds = ((numHorisontal + numVertical) * 2); // Amount of LEDs on all 4 sides
-   static const unsigned int totalNumBytesToSend = totalAmountOfLeds * numValuesPerPixel;
 
-   leds() {
-      brightnessCoef = 1.0;
-      isReady = FALSE;
+   unsigned int numHorisontal;
+   unsigned int numVertical;
 
-      tryConnect(TRUE);
+   ledLayout(unsigned int numHorisontal, unsigned int numVertical) {
+      this->numHorisontal = numHorisontal;
+      this->numVertical = numVertical;
    }
 
-   ~leds() {
-      clearLeds();
-   }
+   unsigned int totalAmountOfLeds() const { return ((numHorisontal + numVertical) * 2); } // Amount of LEDs on all 4 sides
+   unsigned int totalNumBytesToSend() const { return totalAmountOfLeds() * numValuesPerPixel; }
+   BOOL operator==(const ledLayout &other) const { return (numHorisontal == other.numHorisontal) && (numVertical == other.numVertical); }
+};
+
+// A single LED strip with its own layout, crop region and transport.
+// Frames are handed over to a per-device sender thread, so a slow or disconnected device never stalls
+// the capture loop or the other devices. A frame that was not sent yet is replaced by the newer one.
+class leds {
+private:
+   const ledDeviceConfig *config;
+   ledTransport *transport;
+   float brightnessCoef;
+   BOOL isReady;
+
+   HANDLE hSenderThread;
+   HANDLE hFrameEvent;
+   HANDLE hFrameTakenEvent; // auto-reset, the sender has taken the pending frame
+   CRITICAL_SECTION frameLock;
+   BYTE* pendingPixels; // Written by the capture thread, protected by frameLock
+   BYTE* sendPixels;    // Owned by the sender thread
+   BOOL isFramePending;
+   unsigned int numDroppedFrames;
+   unsigned int numSentFrames;
+
+   static DWORD WINAPI senderThread(LPVOID lpParam);
+   void senderLoop();
+   void sendSolidColor(const BYTE red, const BYTE green, const BYTE blue);
+   
+public:
+   ledLayout layout;
 
+   leds(const ledDeviceConfig *config);
+   ~leds();
+
+   const char* getName() { return config->name; }
+   const ledDeviceConfig* getConfig() { return config; }
    float getBrightnessCoef() { return brightnessCoef; }
-   BOOL isConnected() { return serialConnection.isConnected() && isReady; }
+   BOOL isConnected() { return transport->isConnected() && isReady; }
    void setSolidColor(const BYTE red, const BYTE green, const BYTE blue);
    void clearLeds() { setSolidColor(0, 0, 0); }
    void runLedTest();
-   void setLeds(BYTE *finalPixels, int numPixels){ if (isReady) { serialConnection.sendToArduino(finalPixels, numPixels); } }
+   void setLeds(const BYTE *finalPixels, int numPixels);
+   BOOL waitFrameTaken(DWORD timeoutMsec);
+   void start();
+   void stop();
+   void printStats();
    
    void tryConnect(BOOL runTest) 
    {
-      if (!serialConnection.isConnected())
+      if (!transport->isConnected())
       {
          BOOL res;
          isReady = FALSE;
 
-         res = serialConnection.setupSerialComm();
+         res = transport->connect();
          if (res)
          {
             if (runTest)
@@ -132,16 +267,22 @@ public:
 
    void update()
    {
-      unsigned int newWidth = GetSystemMetrics(SM_CXSCREEN);
-      unsigned int newHeight = GetSystemMetrics(SM_CYSCREEN);
+      update(GetSystemMetrics(SM_CXSCREEN), GetSystemMetrics(SM_CYSCREEN));
+   }
 
+   // Returns TRUE if the resolution has changed
+   BOOL update(unsigned int newWidth, unsigned int newHeight)
+   {
       if ((newWidth != this->width) || (newHeight != this->height))
       {
          this->width = newWidth;
          this->height = newHeight;
 
          printf("Screen resolution detected: %dx%d\n", newWidth, newHeight);
+         return TRUE;
       }
+
+      return FALSE;
    }
 };
 
@@ -161,15 +302,20 @@ class screenEdgeDetection {
 public:
    const double sensitivity = 0.01;
    const BOOL stabilityEnable = TRUE;
+   const double probeDepth = 0.25; // Edges are searched up to this part of the screen from each side
 
    screenEdge suggestedEdges;
 };
 
+class regionRequest;
+
 class screen {
 private:
    screenEdgeDetection edgeDetection;
 
 public:
+   static const unsigned int numEdgeProbes = 4; // top, bottom, left, right
+
    screenEdge curEdges;
    screenResolution res;
 
@@ -184,11 +330,507 @@ public:
       curEdges.right = res.width - 1;
    }
 
-   void detectEdges();
+   void getEdgeProbeAreas(screenEdge *areas);
+   void detectEdges(const regionRequest *probes);
+};
+
+// Averages screen zones in software, either in linear light or on the raw sRGB values.
+// Averaging sRGB bytes darkens zones with mixed content and shifts their hue, so in linear light mode each sRGB byte
+// is decoded to a 16 bit linear value through a lookup table, summed per zone and encoded back to sRGB.
+// In sRGB mode the tables are identity, which matches what StretchBlt(HALFTONE) does.
+class zoneAverager {
+private:
+   static const unsigned int encodeTableShift = 4; // 16 bit linear value -> 12 bit encode table index
+   static const unsigned int encodeTableSize = (1 << (16 - encodeTableShift));
+
+   UINT16 decodeTable[256];
+   BYTE encodeTable[encodeTableSize];
+
+   void sumZone(const BYTE* lpPixels, int stride, unsigned int x0, unsigned int x1, unsigned int y0, unsigned int y1, ULONGLONG* sums) const;
+
+public:
+   zoneAverager(BOOL isLinearLight);
+
+   // Averages a zone of a 32bpp bitmap into a single pixel of the same format.
+   // lpPixels points to the bottom left pixel of the zone, stride is the distance (in pixels) to the line above it.
+   void average(const BYTE* lpPixels, int stride, unsigned int width, unsigned int height, BYTE* zonePixel) const;
+};
+
+// Pixels of a captured screen area, 32bpp BGRA. lpPixels points to the bottom line of the area and stride (in pixels)
+// is the distance to the line above it, so both bottom-up and top-down buffers are used without a copy.
+class frameView {
+public:
+   const BYTE* lpPixels; // NULL if the pixels were not read
+   int stride;
+   screenEdge area;      // Screen area held by the frame
+   HDC hDC;              // Memory DC holding the frame, NULL if the frame is not a GDI bitmap
+
+   frameView() {
+      lpPixels = NULL;
+      stride = 0;
+      hDC = NULL;
+   }
+
+   unsigned int width() const { return area.right - area.left + 1; }
+   unsigned int height() const { return area.bottom - area.top + 1; }
+
+   // Pixel at screen coordinates x, y
+   const BYTE* getPixel(unsigned int x, unsigned int y) const {
+      return lpPixels + ((int)(area.bottom - y) * stride + (int)(x - area.left)) * NUM_VALUES_PER_WIN_PIXEL;
+   }
+
+   // Bottom left pixel of a sub area of the frame
+   const BYTE* getAreaPixels(const screenEdge &subArea) const {
+      return lpPixels + ((int)(area.bottom - subArea.bottom) * stride + (int)(subArea.left - area.left)) * NUM_VALUES_PER_WIN_PIXEL;
+   }
+};
+
+// A screen area requested from a frame source, and the captured pixels of it
+class regionRequest {
+public:
+   screenEdge area;
+   BOOL readPixels; // FALSE - a GDI memory DC (frame.hDC) is enough, if the source has one
+   frameView frame;
+};
+
+enum captureResult {
+   CAPTURE_OK,
+   CAPTURE_SKIP_FRAME, // Nothing usable this time (e.g. the producer is busy), try again with the next frame
+   CAPTURE_FAILED      // The source is broken, capturing can't go on
+};
+
+// Producer of the frames the LED colors are computed from.
+// Sources capture only the requested regions of a frame (border strips and edge probes), not the whole frame.
+class frameSource {
+protected:
+   unsigned long long numCapturedBytes;
+   BOOL isErrorReported; // Errors of skipped frames are printed once per failure streak, not on every capture
+
+   // TRUE for the first error since a frame was captured
+   BOOL isFirstError() {
+      BOOL res = !isErrorReported;
+      isErrorReported = TRUE;
+      return res;
+   }
+
+public:
+   static const unsigned int maxNumRegions = gNumLedDevices * 4 + screen::numEdgeProbes;
+
+   frameSource() {
+      numCapturedBytes = 0;
+      isErrorReported = FALSE;
+   }
+   virtual ~frameSource() {}
+
+   virtual const char* getName() = 0;
+   virtual BOOL open() = 0;
+   virtual void close() = 0;
+   virtual void getResolution(unsigned int *width, unsigned int *height) = 0;
+
+   // Captures the requested regions of the current frame
+   virtual captureResult captureRegions(regionRequest *requests, unsigned int numRequests) = 0;
+
+   // Sources that don't copy the frame check it was not overwritten while it was used
+   virtual BOOL isFrameStillValid() { return TRUE; }
+
+   // Sources that hand out the next frame on every capture (files played at max speed) set the pace themselves,
+   // the capture rate is not limited for them
+   virtual BOOL isSelfPaced() { return FALSE; }
+
+   // Pixel bytes captured since the last call
+   unsigned long long takeNumCapturedBytes() {
+      unsigned long long res = numCapturedBytes;
+      numCapturedBytes = 0;
+      return res;
+   }
+};
+
+// Memory DC and 32bpp bottom-up buffer holding a single captured region
+class gdiRegionBuffer {
+private:
+   HBITMAP hBitmap;
+   BITMAPINFO bmInfo;
+
+public:
+   HDC hDC;
+   BYTE* lpPixels;
+   unsigned int width;
+   unsigned int height;
+
+   gdiRegionBuffer() {
+      hDC = NULL;
+      hBitmap = NULL;
+      bmInfo = { 0 };
+      lpPixels = NULL;
+      width = 0;
+      height = 0;
+   }
+
+   ~gdiRegionBuffer() {
+      release();
+   }
+
+   BOOL resize(HDC hScreen, unsigned int newWidth, unsigned int newHeight);
+   BOOL readPixels() { return (0 != GetDIBits(hDC, hBitmap, 0, height, lpPixels, &bmInfo, DIB_RGB_COLORS)); }
+   void release();
+};
+
+// Screen grab through GDI, every region is grabbed into its own memory DC
+class gdiFrameSource : public frameSource {
+private:
+   HDC hScreen;
+   gdiRegionBuffer regions[maxNumRegions];
+
+public:
+   gdiFrameSource() {
+      hScreen = NULL;
+   }
+
+   ~gdiFrameSource() {
+      close();
+   }
+
+   const char* getName() { return "screen (GDI)"; }
+   BOOL open();
+   void close();
+   void getResolution(unsigned int *width, unsigned int *height) {
+      *width = GetSystemMetrics(SM_CXSCREEN);
+      *height = GetSystemMetrics(SM_CYSCREEN);
+   }
+   captureResult captureRegions(regionRequest *requests, unsigned int numRequests);
+};
+
+// Frames pushed by another process through shared memory (see ambilightSharedFrame.h).
+// The frame is used in place - only the requested regions are ever read.
+class sharedMemoryFrameSource : public frameSource {
+private:
+   const wchar_t *mappingName;
+   HANDLE hMapping;
+   const ambilightSharedFrameHeader* header;
+   const BYTE* slots;
+   UINT32 curSlot;
+   LONG64 curSlotSequence;
+
+   // Frame geometry, copied from the header once it was checked against the mapped view. The header belongs
+   // to the producer, only latestFrame and slotSequence[] are read from it after open().
+   unsigned int width;
+   unsigned int height;
+   unsigned int stride;
+   unsigned int slotSize;
+   unsigned int numSlots;
+   BOOL isBottomUp;
+   LONG generation; // Of the producer the geometry was taken from
+
+public:
+   sharedMemoryFrameSource(const wchar_t *mappingName) {
+      this->mappingName = mappingName;
+      hMapping = NULL;
+      header = NULL;
+      slots = NULL;
+      curSlot = 0;
+      curSlotSequence = 0;
+      width = 0;
+      height = 0;
+      stride = 0;
+      slotSize = 0;
+      numSlots = 0;
+      isBottomUp = FALSE;
+      generation = 0;
+   }
+
+   ~sharedMemoryFrameSource() {
+      close();
+   }
+
+   const char* getName() { return "shared memory"; }
+   BOOL open();
+   void close();
+   void getResolution(unsigned int *width, unsigned int *height) {
+      *width = (header != NULL) ? this->width : 0;
+      *height = (header != NULL) ? this->height : 0;
+   }
+   captureResult captureRegions(regionRequest *requests, unsigned int numRequests);
+   BOOL isFrameStillValid();
+};
+
+// Raw 32bpp BGRA frames (top-down, no header) played from a file, for testing without a screen.
+// Only the requested regions are read from the file - lines spanning the whole frame width with a single read.
+class rawFileFrameSource : public frameSource {
+private:
+   const char *fileName;
+   HANDLE hFile;
+   unsigned int width;
+   unsigned int height;
+   unsigned int fps; // 0 - next frame on every capture
+   ULONGLONG numFrames;
+   ULONGLONG curFrame;
+   std::chrono::high_resolution_clock::time_point startTime;
+   BYTE* regionPixels[maxNumRegions]; // Top-down copy of each region, reallocated only when a region grows
+   unsigned int regionBufferSize[maxNumRegions];
+
+   BOOL readRegion(ULONGLONG frameOffset, regionRequest *request, unsigned int index);
+
+public:
+   rawFileFrameSource(const char *fileName, unsigned int width, unsigned int height, unsigned int fps);
+   ~rawFileFrameSource();
+
+   const char* getName() { return "raw file"; }
+   BOOL open();
+   void close();
+   void getResolution(unsigned int *width, unsigned int *height) {
+      *width = this->width;
+      *height = this->height;
+   }
+   captureResult captureRegions(regionRequest *requests, unsigned int numRequests);
+   BOOL isSelfPaced() { return (fps == 0); }
+};
+
+enum yuvFormat {
+   YUV_FORMAT_I420, // Y plane, then U and V planes at half resolution
+   YUV_FORMAT_NV12  // Y plane, then a single plane of interleaved U, V at half resolution
+};
+
+// 4:2:0 video played from a Y4M file (header parsed) or a headerless raw I420/NV12 file, the clip is looped.
+// A reader thread streams whole frames ahead into a small ring of buffers allocated once. Only the requested
+// regions are converted to 32bpp BGRA, the rest of the frame is never touched.
+class yuvFileFrameSource : public frameSource {
+private:
+   static const unsigned int numReadAheadFrames = 4;
+   static const unsigned int maxY4mHeaderSize = 64 * 1024; // The header line, with room for long X (comment) parameters
+
+   const char *fileName;
+   BOOL isY4m;
+   yuvFormat format;
+   unsigned int width;
+   unsigned int height;
+   int fps; // 0 - next frame on every capture, -1 - frame rate of the Y4M header
+   int coefRV, coefGU, coefGV, coefBU; // Limited range YUV -> RGB, 8 bit fixed point
+   HANDLE hFile;
+   LARGE_INTEGER firstFrameOffset;
+   unsigned int frameSize;
+   BYTE* frameBuffers[numReadAheadFrames];
+
+   // Frames are counted in read order over all loops of the clip. The reader fills frame numFramesRead while
+   // numFramesRead - curFrame < numReadAheadFrames, so it never overwrites the frame in use.
+   HANDLE hReaderThread;
+   HANDLE hFrameReadEvent; // auto-reset
+   HANDLE hSlotFreeEvent;  // auto-reset
+   volatile LONG64 numFramesRead;
+   volatile LONG64 curFrame;
+   volatile BOOL isReaderStopping;
+   BOOL isFirstCapture;
+   std::chrono::high_resolution_clock::time_point startTime;
+
+   BYTE* regionPixels[maxNumRegions]; // Top-down BGRA of each region, reallocated only when a region grows
+   unsigned int regionBufferSize[maxNumRegions];
+
+   BOOL parseY4mHeader(char *header);
+   BOOL readFrame(BYTE* frame);
+   static DWORD WINAPI readerThread(LPVOID lpParam);
+   void readerLoop();
+   BOOL convertRegion(const BYTE* frame, regionRequest *request, unsigned int index);
+
+public:
+   // width, height and format are used only for raw files
+   yuvFileFrameSource(const char *fileName, BOOL isY4m, unsigned int width, unsigned int height, yuvFormat format, int fps);
+   ~yuvFileFrameSource();
+
+   const char* getName() { return isY4m ? "Y4M file" : "raw YUV file"; }
+   BOOL open();
+   void close();
+   void getResolution(unsigned int *width, unsigned int *height) {
+      *width = this->width;
+      *height = this->height;
+   }
+   captureResult captureRegions(regionRequest *requests, unsigned int numRequests);
+   BOOL isSelfPaced() { return (fps == 0); }
+};
+
+// Reduction of a screen area to a numHorisontal x numVertical 32bpp bottom-up bitmap, one pixel per LED zone.
+// Only the border zones are used by the LEDs, so only 4 strips (one zone deep) are requested from the frame source.
+// A reduction is shared by all devices that have the same layout and crop region.
+class zoneReduction {
+private:
+   HDC hDC;
+   HBITMAP hBitmap;
+   BITMAPINFO bmInfo;
+   screenEdge curArea;      // Area of the current frame
+   unsigned int firstRequest; // Strips requested for the current frame - bottom, top, left, right
+   unsigned int numRequests;
+
+   void getZoneArea(unsigned int zx, unsigned int zy, screenEdge *zone) const;
+
+public:
+   static const unsigned int maxNumRequests = 4;
+
+   ledLayout layout;
+   const ledDeviceConfig *config; // Crop region
+   BYTE* lpPixels;
+   BOOL isNeeded; // At least one connected device is using this reduction
+   BOOL isLinearLight;
+
+   zoneReduction(const ledDeviceConfig *config);
+   ~zoneReduction();
+
+   BOOL isSameAs(const ledDeviceConfig *other) const {
+      return (layout == ledLayout(other->numHorisontal, other->numVertical))
+         && (config->cropLeft == other->cropLeft) && (config->cropTop == other->cropTop)
+         && (config->cropRight == other->cropRight) && (config->cropBottom == other->cropBottom);
+   }
+   void getArea(const screenEdge &screenArea, screenEdge *area) const;
+   unsigned int addRegionRequests(const screenEdge &screenArea, regionRequest *requests, unsigned int firstRequest);
+   BOOL reduce(const regionRequest *requests);
+};
+
+// Average per-frame timings of the capture loop, printed every gStatsIntervalFrames frames
+class captureStats {
+private:
+   unsigned int numFrames;
+   long long captureUsec, reduceUsec;
+   unsigned long long capturedBytes, fullFrameBytes;
+   std::chrono::high_resolution_clock::time_point intervalStart;
+
+public:
+   captureStats() { reset(); }
+
+   void reset() {
+      numFrames = 0;
+      captureUsec = 0;
+      reduceUsec = 0;
+      capturedBytes = 0;
+      fullFrameBytes = 0;
+      intervalStart = std::chrono::high_resolution_clock::now();
+   }
+
+   BOOL addFrame(long long captureTime, long long reduceTime, unsigned long long frameCapturedBytes, unsigned long long frameFullBytes);
+};
+
+enum captureRateMode {
+   CAPTURE_RATE_ACTIVE,
+   CAPTURE_RATE_STATIC,
+   CAPTURE_RATE_IDLE,
+   CAPTURE_RATE_NUM_MODES
+};
+
+// Picks the capture rate from the frame-to-frame change of the LED colors of all devices.
+// Every frame: beginFrame(), addLeds() for each device, endFrame(), then wait getWaitMsec() before the next frame.
+class captureRateController {
+private:
+   BYTE* prevLeds; // LED colors of the previous frame, every device at its own offset
+   unsigned int numBytes;
+   BOOL isChanged;
+   BOOL isBlack;
+   captureRateMode mode;
+   BOOL isSelfPaced; // The frame source sets the pace, capture at full speed
+   std::chrono::high_resolution_clock::time_point lastChange;
+   std::chrono::high_resolution_clock::time_point lastNotBlack;
+   std::chrono::high_resolution_clock::time_point frameStart;
+
+   // Statistics of the current interval
+   std::chrono::high_resolution_clock::time_point intervalStart;
+   long long modeUsec[CAPTURE_RATE_NUM_MODES];
+   unsigned int numFrames;
+   ULONGLONG intervalCpuTime;
+
+   static ULONGLONG getThreadCpuTime();
+
+public:
+   captureRateController(unsigned int numBytes, BOOL isSelfPaced);
+   ~captureRateController();
+
+   static unsigned int getModeFps(captureRateMode mode);
+   static const char* getModeName(captureRateMode mode);
+
+   void beginFrame();
+   void addLeds(unsigned int offset, const BYTE* leds, unsigned int numLedBytes);
+   void endFrame();
+   DWORD getWaitMsec() const;
+   void printStats();
+};
+
+// LED recording file - a ledRecordingFileHeader followed by frames, each a ledRecordingFrameHeader and its payload.
+// Delta payloads are runs of: unchanged byte count (1 byte), changed byte count (1 byte), the changed bytes.
+#pragma pack(push, 1)
+struct ledRecordingFileHeader {
+   UINT32 magic;
+   UINT32 version;
+};
+
+struct ledRecordingFrameHeader {
+   UINT64 timeUsec;    // Since the start of the recording
+   UINT16 deviceIndex; // Layout id - index in gLedDeviceConfigs, with the layout of the device
+   UINT16 numHorisontal;
+   UINT16 numVertical;
+   UINT16 flags;       // LED_RECORDING_xxx
+   UINT32 numBytes;    // Size of the decoded frame
+   UINT32 payloadSize;
+};
+#pragma pack(pop)
+
+// Records every frame handed to leds::setLeds(). The capture thread only copies the frame into a ring of
+// preallocated slots (the frame is dropped if the ring is full), a writer thread delta-compresses and writes it.
+class ledRecorder {
+private:
+   static const unsigned int numSlots = 64;
+   static const unsigned int keyFrameInterval = 300; // Frames of a device between two key frames
+
+   struct recordingSlot {
+      UINT64 timeUsec;
+      unsigned int deviceIndex;
+      unsigned int numHorisontal, numVertical;
+      unsigned int numBytes;
+      BYTE* pixels;
+   };
+
+   const char *fileName;
+   HANDLE hFile;
+   unsigned int maxNumBytes;
+   recordingSlot slots[numSlots];
+   std::chrono::high_resolution_clock::time_point startTime;
+
+   // Single producer (capture thread), single consumer (writer thread)
+   HANDLE hWriterThread;
+   HANDLE hFrameEvent; // auto-reset
+   volatile LONG64 numFramesAdded;
+   volatile LONG64 numFramesWritten;
+   volatile LONG numDroppedFrames;
+   volatile BOOL isStopping;
+
+   // Owned by the writer thread
+   BYTE* prevFrames[gNumLedDevices];
+   unsigned int framesSinceKeyFrame[gNumLedDevices];
+   BYTE* payload;
+   BYTE* writeBuffer;
+   unsigned int writeBufferSize;
+   unsigned int writeBufferUsed;
+   ULONGLONG numBytesWritten;
+
+   static DWORD WINAPI writerThread(LPVOID lpParam);
+   void writerLoop();
+   void writeFrame(const recordingSlot &slot);
+   BOOL write(const void* data, unsigned int size);
+   BOOL flush();
+
+public:
+   ledRecorder(const char *fileName, unsigned int maxNumBytes);
+   ~ledRecorder();
+
+   BOOL start();
+   void stop();
+   void addFrame(unsigned int deviceIndex, const ledLayout &layout, const BYTE* pixels, unsigned int numBytes);
+
+   static unsigned int encodeDelta(const BYTE* frame, const BYTE* prevFrame, unsigned int numBytes, BYTE* payload);
+   static BOOL decodeDelta(const BYTE* payload, unsigned int payloadSize, BYTE* frame, unsigned int numBytes);
 };
 
-leds gLeds;
+leds* gLedDevices[gNumLedDevices];
 screen gScreen;
+frameSource* gFrameSource;
+ledRecorder* gLedRecorder = NULL;
+const char* gReplayFileName = NULL; // Replay a recording instead of capturing
+BOOL gReplayMaxSpeed = FALSE;
+zoneAverager gLinearLightAverager(TRUE);
+zoneAverager gSrgbAverager(FALSE);
 
 BOOL serialCon::setupSerialComm()
 {
@@ -295,195 +937,493 @@ void serialCon::sendToArduino(BYTE *finalPixels, int numPixels)
    }
 }
 
-void leds::setSolidColor(const BYTE red, const BYTE green, const BYTE blue)
+udpCon::udpCon(const char *host, unsigned int port, unsigned int maxNumBytesPerFrame)
 {
-   BYTE* finalPixals = new BYTE[totalNumBytesToSend];
-   unsigned int i = 0;
-
-   for (i = 0; i < totalNumBytesToSend; i += numValuesPerPixel)
-   {
-      finalPixals[i + 0] = red;
-      finalPixals[i + 1] = green;
-      finalPixals[i + 2] = blue;
-   }
-
-   serialConnection.sendToArduino(finalPixals, totalNumBytesToSend);
-
-   delete[] finalPixals;
+   unsigned int maxNumPackets = (maxNumBytesPerFrame + ddpMaxDataSize - 1) / ddpMaxDataSize;
+
+   hSocket = INVALID_SOCKET;
+   isUdpConnected = FALSE;
+   isSegmentationOffload = FALSE;
+   this->host = host;
+   this->port = port;
+   this->maxNumBytesPerFrame = maxNumBytesPerFrame;
+   packetBuffer = new BYTE[maxNumPackets * ddpPacketSize];
+   sequence = 0;
 }
 
-void screen::detectEdges()
+udpCon::~udpCon()
 {
-   unsigned int newTopEdge, newBottomEdge, newLeftEdge, newRightEdge;
-   unsigned int x, y, x_add, valCount, sum;
-   double precession;
-   BYTE* lpPixels;
+   closeConnection();
+   delete[] packetBuffer;
+}
 
-   // copy screen to bitmap
-   HDC     hScreen = GetDC(NULL);
-   HDC     hDC = CreateCompatibleDC(hScreen);
-   HBITMAP hBitmap = CreateCompatibleBitmap(hScreen, res.width, res.height);
-   BITMAPINFO MyBMInfo = { 0 };
+BOOL udpCon::connect()
+{
+   WSADATA wsaData;
+   struct addrinfo hints = { 0 };
+   struct addrinfo *addr = NULL;
+   char portString[8];
 
-   SelectObject(hDC, hBitmap);
+   isUdpConnected = FALSE;
 
-   if ((curEdges.top == MAXINT32) || (curEdges.bottom == MAXINT32)
-      || (curEdges.left == MAXINT32) || (curEdges.right == MAXINT32))
+   if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0)
    {
-      printf("Initial screen edge detection, setting default values\n");
-      setDefaultEdges();
+      return FALSE;
    }
 
-   newTopEdge = curEdges.top;
-   newBottomEdge = curEdges.bottom;
-   newLeftEdge = curEdges.left;
-   newRightEdge = curEdges.right;
-
-   MyBMInfo.bmiHeader.biSize = sizeof(MyBMInfo.bmiHeader);
-
-   // Get the BITMAPINFO structure from the bitmap
-   if (0 == GetDIBits(hDC, hBitmap, 0, 0, NULL, &MyBMInfo, DIB_RGB_COLORS))
+   hints.ai_family = AF_INET;
+   hints.ai_socktype = SOCK_DGRAM;
+   hints.ai_protocol = IPPROTO_UDP;
+   sprintf_s(portString, sizeof(portString), "%u", port);
+   if ((getaddrinfo(host, portString, &hints, &addr) != 0) || (addr == NULL))
    {
-      printf("Error!!! detectScreenEdges:GetDIBits 1 failed\n");
-      return;
+      WSACleanup();
+      return FALSE;
    }
 
-   MyBMInfo.bmiHeader.biBitCount = 32;
-   MyBMInfo.bmiHeader.biCompression = BI_RGB;  // no compression -> easier to use
-   MyBMInfo.bmiHeader.biHeight = abs(MyBMInfo.bmiHeader.biHeight); // correct the bottom-up ordering of lines
-
-   if (!BitBlt(hDC, 0, 0, res.width, res.height, hScreen, 0, 0, SRCCOPY))
+   hSocket = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+   if (hSocket == INVALID_SOCKET)
    {
-      printf("Error!!!\n");
-      return;
+      freeaddrinfo(addr);
+      WSACleanup();
+      return FALSE;
    }
 
-   // Call GetDIBits a second time, this time to (format and) store the actual
-   // bitmap data (the "pixels") in the buffer lpPixels
-   lpPixels = new BYTE[MyBMInfo.bmiHeader.biSizeImage];
-   if (0 == GetDIBits(hDC, hBitmap, 0, MyBMInfo.bmiHeader.biHeight, lpPixels, &MyBMInfo, DIB_RGB_COLORS))
+   // Connected UDP socket - the destination is resolved once, send() doesn't need it every frame
+   if (::connect(hSocket, addr->ai_addr, (int)addr->ai_addrlen) == SOCKET_ERROR)
    {
-      printf("Error!!! detectScreenEdges:GetDIBits 2 failed\n");
-      return;
+      freeaddrinfo(addr);
+      closesocket(hSocket);
+      hSocket = INVALID_SOCKET;
+      WSACleanup();
+      return FALSE;
+   }
+   freeaddrinfo(addr);
+
+   // UDP segmentation offload (Windows 10 1709 and up) lets a single send() carry all the packets of a frame,
+   // the same way sendmmsg() does on Linux. Fall back to a send() per packet if it is not supported.
+   isSegmentationOffload = FALSE;
+#ifdef UDP_SEND_MSG_SIZE
+   DWORD segmentSize = ddpPacketSize;
+   if (setsockopt(hSocket, IPPROTO_UDP, UDP_SEND_MSG_SIZE, (const char*)&segmentSize, sizeof(segmentSize)) == 0)
+   {
+      isSegmentationOffload = TRUE;
    }
+#endif // UDP_SEND_MSG_SIZE
 
-   //Find top edge
-   for (y = 0; y < res.height; y++)
+   printf("UDP output connected to %s:%u (%s)\n", host, port, isSegmentationOffload ? "segmentation offload" : "packet per send");
+
+   isUdpConnected = TRUE;
+   return TRUE;
+}
+
+void udpCon::closeConnection()
+{
+   if (hSocket != INVALID_SOCKET)
    {
-      unsigned int inv_y = res.height - 1 - y;
-      sum = 0;
-      valCount = 0;
-      x_add = inv_y * res.width * NUM_VALUES_PER_WIN_PIXEL;
+      closesocket(hSocket);
+      hSocket = INVALID_SOCKET;
+      isUdpConnected = FALSE;
+      WSACleanup();
+   }
+}
 
-      for (x = 0; x < (res.width * NUM_VALUES_PER_WIN_PIXEL); x++)
-      {
-         if (x % NUM_VALUES_PER_WIN_PIXEL == leds::numValuesPerPixel)
-            continue; //Don't count the alpha channel
+void udpCon::send(BYTE *finalPixels, int numPixels)
+{
+   unsigned int offset = 0;
+   unsigned int bufferSize = 0;
+   unsigned int numBytes = ((unsigned int)numPixels < maxNumBytesPerFrame) ? numPixels : maxNumBytesPerFrame;
 
-         sum += lpPixels[x + x_add];
-         valCount++;
-      }
+   if (!isUdpConnected)
+      return;
 
-      precession = (double)sum / valCount / MAXBYTE;
-      if (precession > edgeDetection.sensitivity)
-      {
-         newTopEdge = y;
-         //if (gCurEdges.top != newTopEdge) printf("Detected new top edge - %d, precession - %f\n", newTopEdge, precession);
+   // Sequence numbers are 1..15, 0 means "not used"
+   sequence = (sequence % 15) + 1;
 
-         break;
-      }
+   // Build all packets of the frame in the preallocated buffer
+   while (offset < numBytes)
+   {
+      BYTE* packet = &packetBuffer[bufferSize];
+      unsigned int dataSize = ((numBytes - offset) < ddpMaxDataSize) ? (numBytes - offset) : ddpMaxDataSize;
+      BOOL isLastPacket = (offset + dataSize >= numBytes);
+
+      packet[0] = 0x40 | (isLastPacket ? 0x01 : 0x00); // Version 1, push flag on the last packet
+      packet[1] = sequence;
+      packet[2] = 0x0B; // RGB, 8 bit per color
+      packet[3] = 0x01; // Default output device
+      packet[4] = (BYTE)(offset >> 24); // Data offset in bytes, big endian
+      packet[5] = (BYTE)(offset >> 16);
+      packet[6] = (BYTE)(offset >> 8);
+      packet[7] = (BYTE)(offset);
+      packet[8] = (BYTE)(dataSize >> 8); // Data length, big endian
+      packet[9] = (BYTE)(dataSize);
+      memcpy(&packet[ddpHeaderSize], &finalPixels[offset], dataSize);
+
+      offset += dataSize;
+      bufferSize += ddpHeaderSize + dataSize;
    }
 
-   //Find bottom edge
-   for (y = 0; y < res.height; y++)
+   if (isSegmentationOffload)
    {
-      sum = 0;
-      x_add = y * res.width * NUM_VALUES_PER_WIN_PIXEL;
-
-      for (x = 0; x < (res.width * NUM_VALUES_PER_WIN_PIXEL); x++)
-      {
-         if (x % NUM_VALUES_PER_WIN_PIXEL == leds::numValuesPerPixel)
-            continue; //Don't count the alpha channel
-         sum += lpPixels[x + x_add];
-      }
-
-      precession = (double)sum / valCount / MAXBYTE;
-      if (precession > edgeDetection.sensitivity)
+      // Only the last packet may be shorter than the segment size, which is how the buffer is built
+      if (::send(hSocket, (const char*)packetBuffer, bufferSize, 0) == SOCKET_ERROR)
       {
-         newBottomEdge = res.height - y - 1;
-         //if (gCurEdges.bottom != newBottomEdge) printf("Detected new bottom edge - %d, precession - %f\n", newBottomEdge, precession);
-
-         break;
+         closeConnection();
       }
+      return;
    }
 
-   //Find left edge
-   for (x = 0; x < res.width; x++)
+   for (offset = 0; offset < bufferSize; offset += ddpPacketSize)
    {
-      unsigned int pixel_x;
-      sum = 0;
-      valCount = 0;
+      unsigned int packetSize = ((bufferSize - offset) < ddpPacketSize) ? (bufferSize - offset) : ddpPacketSize;
 
-      //no need to count the Alpha channel
-      for (pixel_x = 0; pixel_x < leds::numValuesPerPixel; pixel_x++)
+      if (::send(hSocket, (const char*)&packetBuffer[offset], packetSize, 0) == SOCKET_ERROR)
       {
-         unsigned int final_pixel_x = (x * NUM_VALUES_PER_WIN_PIXEL) + pixel_x;
-         for (y = 0; y < res.height; y++)
-         {
-            x_add = y * res.width * NUM_VALUES_PER_WIN_PIXEL;
-
-            sum += lpPixels[final_pixel_x + x_add];
-            valCount++;
-         }
+         closeConnection();
+         return;
       }
+   }
+}
 
-      precession = (double)sum / valCount / MAXBYTE;
-      if (precession > edgeDetection.sensitivity)
-      {
-         newLeftEdge = x;
-         //if (gCurEdges.left != newLeftEdge) printf("Detected new left edge - %d, precession - %f\n", newLeftEdge, precession);
+leds::leds(const ledDeviceConfig *config) : layout(config->numHorisontal, config->numVertical)
+{
+   this->config = config;
+   brightnessCoef = 1.0;
+   isReady = FALSE;
 
-         break;
-      }
+   switch (config->transport)
+   {
+   case TRANSPORT_UDP:
+      transport = new udpCon(config->host, config->port, layout.totalNumBytesToSend());
+      break;
+
+   case TRANSPORT_SERIAL:
+   default:
+      transport = new serialCon(config->portName);
+      break;
    }
 
-   //Find right edge
-   for (x = 0; x < res.width; x++)
-   {
-      unsigned int inv_x = res.width - 1 - x;
-      unsigned int pixel_x;
-      sum = 0;
-      valCount = 0;
+   hSenderThread = NULL;
+   hFrameEvent = CreateEvent(NULL, FALSE, FALSE, NULL); // auto-reset
+   hFrameTakenEvent = CreateEvent(NULL, FALSE, FALSE, NULL); // auto-reset
+   InitializeCriticalSection(&frameLock);
+   pendingPixels = new BYTE[layout.totalNumBytesToSend()];
+   sendPixels = new BYTE[layout.totalNumBytesToSend()];
+   isFramePending = FALSE;
+   numDroppedFrames = 0;
+   numSentFrames = 0;
+}
 
-      //no need to count the Alpha channel
-      for (pixel_x = 0; pixel_x < leds::numValuesPerPixel; pixel_x++)
-      {
-         unsigned int final_pixel_x = (inv_x * NUM_VALUES_PER_WIN_PIXEL) + pixel_x;
-         for (y = 0; y < res.height; y++)
-         {
-            x_add = y * res.width * NUM_VALUES_PER_WIN_PIXEL;
+leds::~leds()
+{
+   stop();
 
-            sum += lpPixels[final_pixel_x + x_add];
-            valCount++;
+   if (isConnected())
+   {
+      sendSolidColor(0, 0, 0);
+   }
+
+   delete transport;
+   delete[] pendingPixels;
+   delete[] sendPixels;
+   DeleteCriticalSection(&frameLock);
+   CloseHandle(hFrameEvent);
+   CloseHandle(hFrameTakenEvent);
+}
+
+void leds::start()
+{
+   DWORD dwThreadId;
+
+   hSenderThread = CreateThread(NULL, 0, senderThread, this, 0, &dwThreadId);
+   if (hSenderThread == NULL)
+      printf("Device '%s': sender thread failed, error: %d\n", config->name, GetLastError());
+   else
+      printf("Device '%s': sender thread started... (ID %d)\n", config->name, dwThreadId);
+}
+
+void leds::stop()
+{
+   if (hSenderThread != NULL)
+   {
+      // The sender loop is terminated by gExitProgram, wake it up in case it is waiting for a frame
+      SetEvent(hFrameEvent);
+      WaitForSingleObject(hSenderThread, INFINITE);
+      CloseHandle(hSenderThread);
+      hSenderThread = NULL;
+   }
+}
+
+DWORD WINAPI leds::senderThread(LPVOID lpParam)
+{
+   ((leds*)lpParam)->senderLoop();
+   return 0;
+}
+
+void leds::senderLoop()
+{
+   BOOL allowFastReconnect = FALSE;
+
+   while (!gExitProgram)
+   {
+      if (!isConnected())
+      {
+         tryConnect(!allowFastReconnect);
+         allowFastReconnect = FALSE;
+
+         if (!isConnected())
+         {
+            Sleep(500);
+            continue;
          }
       }
+      allowFastReconnect = TRUE;
+
+      if (WaitForSingleObject(hFrameEvent, 500) != WAIT_OBJECT_0)
+      {
+         continue;
+      }
+
+      EnterCriticalSection(&frameLock);
+      BOOL hasFrame = isFramePending;
+      if (hasFrame)
+      {
+         memcpy(sendPixels, pendingPixels, layout.totalNumBytesToSend());
+         isFramePending = FALSE;
+         numSentFrames++;
+      }
+      LeaveCriticalSection(&frameLock);
+
+      if (hasFrame)
+      {
+         SetEvent(hFrameTakenEvent);
+         transport->send(sendPixels, layout.totalNumBytesToSend());
+      }
+   }
+}
+
+void leds::setLeds(const BYTE *finalPixels, int numPixels)
+{
+   if (!isReady)
+      return;
+
+   if (numPixels > (int)layout.totalNumBytesToSend())
+      numPixels = layout.totalNumBytesToSend();
+
+   if (gLedRecorder != NULL)
+   {
+      gLedRecorder->addFrame((unsigned int)(config - gLedDeviceConfigs), layout, finalPixels, numPixels);
+   }
+
+   EnterCriticalSection(&frameLock);
+   if (isFramePending)
+   {
+      numDroppedFrames++; // The sender did not keep up, the previous frame is replaced
+   }
+   memcpy(pendingPixels, finalPixels, numPixels);
+   isFramePending = TRUE;
+   LeaveCriticalSection(&frameLock);
+
+   SetEvent(hFrameEvent);
+}
+
+// Waits until the sender has taken the pending frame, so the next setLeds() doesn't replace it.
+// Returns FALSE on timeout, e.g. when the device got disconnected.
+BOOL leds::waitFrameTaken(DWORD timeoutMsec)
+{
+   auto start = std::chrono::high_resolution_clock::now();
+
+   while (!gExitProgram)
+   {
+      EnterCriticalSection(&frameLock);
+      BOOL isPending = isFramePending;
+      LeaveCriticalSection(&frameLock);
+
+      if (!isPending)
+         return TRUE;
+
+      // The event may still be set by an earlier frame, so the pending flag is checked again after every wake up
+      long long elapsedMsec = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock::now() - start).count();
+      if (elapsedMsec >= timeoutMsec)
+         return FALSE;
+
+      WaitForSingleObject(hFrameTakenEvent, (DWORD)(timeoutMsec - elapsedMsec));
+   }
+
+   return FALSE;
+}
+
+void leds::setSolidColor(const BYTE red, const BYTE green, const BYTE blue)
+{
+   unsigned int i = 0;
+
+   EnterCriticalSection(&frameLock);
+   for (i = 0; i < layout.totalNumBytesToSend(); i += ledLayout::numValuesPerPixel)
+   {
+      pendingPixels[i + 0] = red;
+      pendingPixels[i + 1] = green;
+      pendingPixels[i + 2] = blue;
+   }
+   isFramePending = TRUE;
+   LeaveCriticalSection(&frameLock);
+
+   SetEvent(hFrameEvent);
+}
+
+// Sends a solid color directly, used from the sender thread (and after it was stopped)
+void leds::sendSolidColor(const BYTE red, const BYTE green, const BYTE blue)
+{
+   BYTE* finalPixals = new BYTE[layout.totalNumBytesToSend()];
+   unsigned int i = 0;
+
+   for (i = 0; i < layout.totalNumBytesToSend(); i += ledLayout::numValuesPerPixel)
+   {
+      finalPixals[i + 0] = red;
+      finalPixals[i + 1] = green;
+      finalPixals[i + 2] = blue;
+   }
+
+   transport->send(finalPixals, layout.totalNumBytesToSend());
+
+   delete[] finalPixals;
+}
+
+void leds::printStats()
+{
+   unsigned int dropped, sent;
+
+   EnterCriticalSection(&frameLock);
+   dropped = numDroppedFrames;
+   numDroppedFrames = 0;
+   sent = numSentFrames;
+   numSentFrames = 0;
+   LeaveCriticalSection(&frameLock);
+
+   printf("   Device '%s': %s, %d frames sent, %d frames dropped\n", config->name, isConnected() ? "connected" : "disconnected", sent, dropped);
+}
+
+// Bands the edges are searched in - top and bottom bands span the whole width, left and right bands only the
+// lines between them. Captured with the frame every gEdgeDetectionCheckIntervalSec, instead of a full screen grab.
+void screen::getEdgeProbeAreas(screenEdge *areas)
+{
+   unsigned int depthX = (unsigned int)(res.width * edgeDetection.probeDepth);
+   unsigned int depthY = (unsigned int)(res.height * edgeDetection.probeDepth);
+
+   if (depthX < 1) depthX = 1;
+   if (depthY < 1) depthY = 1;
+
+   //Top
+   areas[0].left = 0;
+   areas[0].right = res.width - 1;
+   areas[0].top = 0;
+   areas[0].bottom = depthY - 1;
+
+   //Bottom
+   areas[1].left = 0;
+   areas[1].right = res.width - 1;
+   areas[1].top = res.height - depthY;
+   areas[1].bottom = res.height - 1;
+
+   //Left
+   areas[2].left = 0;
+   areas[2].right = depthX - 1;
+   areas[2].top = depthY;
+   areas[2].bottom = res.height - depthY - 1;
+
+   //Right
+   areas[3].left = res.width - depthX;
+   areas[3].right = res.width - 1;
+   areas[3].top = depthY;
+   areas[3].bottom = res.height - depthY - 1;
+}
+
+// Average brightness of a line (isColumn == FALSE) or a column of a probe band, alpha channel is not counted
+double getProbeLineBrightness(const frameView &probe, unsigned int pos, BOOL isColumn)
+{
+   unsigned int i, color, sum = 0, valCount = 0;
+   unsigned int length = isColumn ? probe.height() : probe.width();
+
+   for (i = 0; i < length; i++)
+   {
+      const BYTE* pixel = isColumn ? probe.getPixel(pos, probe.area.top + i) : probe.getPixel(probe.area.left + i, pos);
+
+      for (color = 0; color < ledLayout::numValuesPerPixel; color++)
+      {
+         sum += pixel[color];
+         valCount++;
+      }
+   }
+
+   return (valCount > 0) ? ((double)sum / valCount / MAXBYTE) : 0;
+}
+
+// probes[] are the bands of getEdgeProbeAreas(), captured with their pixels
+void screen::detectEdges(const regionRequest *probes)
+{
+   unsigned int newTopEdge, newBottomEdge, newLeftEdge, newRightEdge;
+   unsigned int x, y;
+   const frameView &top = probes[0].frame;
+   const frameView &bottom = probes[1].frame;
+   const frameView &left = probes[2].frame;
+   const frameView &right = probes[3].frame;
+
+   if ((curEdges.top == MAXINT32) || (curEdges.bottom == MAXINT32)
+      || (curEdges.left == MAXINT32) || (curEdges.right == MAXINT32))
+   {
+      printf("Initial screen edge detection, setting default values\n");
+      setDefaultEdges();
+   }
+
+   newTopEdge = curEdges.top;
+   newBottomEdge = curEdges.bottom;
+   newLeftEdge = curEdges.left;
+   newRightEdge = curEdges.right;
 
-      precession = (double)sum / valCount / MAXBYTE;
-      if (precession > edgeDetection.sensitivity)
+   //Find top edge
+   for (y = top.area.top; y <= top.area.bottom; y++)
+   {
+      if (getProbeLineBrightness(top, y, FALSE) > edgeDetection.sensitivity)
       {
-         newRightEdge = inv_x;
-         //if (gCurEdges.right != newRightEdge) printf("Detected new right edge - %d, precession - %f\n", newRightEdge, precession);
-         
+         newTopEdge = y;
          break;
       }
    }
 
+   //Find bottom edge
+   for (y = bottom.area.bottom; y >= bottom.area.top; y--)
+   {
+      if (getProbeLineBrightness(bottom, y, FALSE) > edgeDetection.sensitivity)
+      {
+         newBottomEdge = y;
+         break;
+      }
 
-   // clean up
-   delete[] lpPixels;
-   DeleteObject(hBitmap);
-   DeleteDC(hDC);
-   ReleaseDC(NULL, hScreen);
+      if (y == 0)
+         break;
+   }
+
+   //Find left edge
+   for (x = left.area.left; x <= left.area.right; x++)
+   {
+      if (getProbeLineBrightness(left, x, TRUE) > edgeDetection.sensitivity)
+      {
+         newLeftEdge = x;
+         break;
+      }
+   }
+
+   //Find right edge
+   for (x = right.area.right; x >= right.area.left; x--)
+   {
+      if (getProbeLineBrightness(right, x, TRUE) > edgeDetection.sensitivity)
+      {
+         newRightEdge = x;
+         break;
+      }
+
+      if (x == 0)
+         break;
+   }
 
    if ((newTopEdge >= res.height) || (newBottomEdge > res.height) || (newTopEdge >= newBottomEdge)
       || (newRightEdge >= res.width) || (newLeftEdge > res.width) || (newLeftEdge >= newRightEdge))
@@ -522,10 +1462,9 @@ void screen::detectEdges()
 }
 
 // Translate windows pixel format (BGRA) to WS2812b format (RGB)
-inline void translateWin2LedPixel(const BYTE* winPixel, BYTE* ledPixel, const float brightnessNormalizationCoef)
+inline void translateWin2LedPixel(const BYTE* winPixel, BYTE* ledPixel, const float bCoef, const float brightnessNormalizationCoef)
 {
    int red, green, blue;
-   float bCoef = gLeds.getBrightnessCoef();
 
    //alpha = lpPixels[pixel + 3];
    red = *(winPixel + 2);
@@ -537,269 +1476,2428 @@ inline void translateWin2LedPixel(const BYTE* winPixel, BYTE* ledPixel, const fl
    *(ledPixel + 2) = (BYTE)(blue  * bCoef * brightnessNormalizationCoef);
 }
 
-void prepareLedColors(BYTE *finalPixals, const BYTE* lpPixels, const BITMAPINFO *MyBMInfo)
+void prepareLedColors(BYTE *finalPixals, const BYTE* lpPixels, const ledLayout &layout, const float bCoef)
 {
    int x, y, x_add; // Note: x,y must be signed, some loops are depended on it
    int pixel, finalPixel;
    float brightnessNormalizationCoef;
 
-   int stride = MyBMInfo->bmiHeader.biWidth;
+   int stride = layout.numHorisontal;
    finalPixel = 0;
 
    //Bottom side
    x = 0; y = 0;
    x_add = y * stride;
-   for (x = 0; x < (int)leds::numHorisontal; x++)
+   for (x = 0; x < (int)layout.numHorisontal; x++)
    {
       pixel = (x + x_add) * NUM_VALUES_PER_WIN_PIXEL;
 
       // Corner screen areas will light 2 leds, so I'm reducing brightness by 50% to compensate
-      if ((x == 0) || (x == leds::numHorisontal - 1))
+      if ((x == 0) || (x == layout.numHorisontal - 1))
          brightnessNormalizationCoef = 0.5;
       else
          brightnessNormalizationCoef = 1;
 
-      translateWin2LedPixel(&lpPixels[pixel], &finalPixals[finalPixel], brightnessNormalizationCoef);
+      translateWin2LedPixel(&lpPixels[pixel], &finalPixals[finalPixel], bCoef, brightnessNormalizationCoef);
 
-      finalPixel += leds::numValuesPerPixel;
+      finalPixel += ledLayout::numValuesPerPixel;
    }
 
    //Right side
-   x = leds::numHorisontal - 1;
-   for (y = 0; y < (int)leds::numVertical; y++)
+   x = layout.numHorisontal - 1;
+   for (y = 0; y < (int)layout.numVertical; y++)
    {
       x_add = y * stride;
       pixel = (x + x_add) * NUM_VALUES_PER_WIN_PIXEL;
 
       // Corner screen areas will light 2 leds, so I'm reducing brightness by 50% to compensate
-      if ((y == 0) || (y == (leds::numVertical - 1)))
+      if ((y == 0) || (y == (layout.numVertical - 1)))
          brightnessNormalizationCoef = 0.5;
       else
          brightnessNormalizationCoef = 1;
 
-      translateWin2LedPixel(&lpPixels[pixel], &finalPixals[finalPixel], brightnessNormalizationCoef);
+      translateWin2LedPixel(&lpPixels[pixel], &finalPixals[finalPixel], bCoef, brightnessNormalizationCoef);
 
-      finalPixel += leds::numValuesPerPixel;
+      finalPixel += ledLayout::numValuesPerPixel;
    }
 
    //Top side
-   y = leds::numVertical - 1;
+   y = layout.numVertical - 1;
    x_add = y * stride;
-   for (x = leds::numHorisontal - 1; x >= 0; x--)
+   for (x = layout.numHorisontal - 1; x >= 0; x--)
    {
       pixel = (x + x_add) * NUM_VALUES_PER_WIN_PIXEL;
 
       // Corner screen areas will light 2 leds, so I'm reducing brightness by 50% to compensate
-      if ((x == 0) || (x == leds::numHorisontal - 1))
+      if ((x == 0) || (x == layout.numHorisontal - 1))
          brightnessNormalizationCoef = 0.5;
       else
          brightnessNormalizationCoef = 1;
 
-      translateWin2LedPixel(&lpPixels[pixel], &finalPixals[finalPixel], brightnessNormalizationCoef);
+      translateWin2LedPixel(&lpPixels[pixel], &finalPixals[finalPixel], bCoef, brightnessNormalizationCoef);
 
-      finalPixel += leds::numValuesPerPixel;
+      finalPixel += ledLayout::numValuesPerPixel;
    }
 
    //Left side
    x = 0;
-   for (y = leds::numVertical - 1; y >= 0; y--)
+   for (y = layout.numVertical - 1; y >= 0; y--)
    {
       x_add = y * stride;
       pixel = (x + x_add) * NUM_VALUES_PER_WIN_PIXEL;
 
       // Corner screen areas will light 2 leds, so I'm reducing brightness by 50% to compensate
-      if ((y == 0) || (y == (leds::numVertical - 1)))
+      if ((y == 0) || (y == (layout.numVertical - 1)))
          brightnessNormalizationCoef = 0.5;
       else
          brightnessNormalizationCoef = 1;
 
-      translateWin2LedPixel(&lpPixels[pixel], &finalPixals[finalPixel], brightnessNormalizationCoef);
+      translateWin2LedPixel(&lpPixels[pixel], &finalPixals[finalPixel], bCoef, brightnessNormalizationCoef);
 
-      finalPixel += leds::numValuesPerPixel;
+      finalPixel += ledLayout::numValuesPerPixel;
    }
 }
 
-void captureLoop()
-{
-   // copy screen to bitmap
-   HDC     hScreen = GetDC(NULL);
-   HDC     hDC = CreateCompatibleDC(hScreen);
-   HBITMAP hBitmap = CreateCompatibleBitmap(hScreen, leds::numHorisontal, leds::numVertical);
-
-   SelectObject(hDC, hBitmap);
-
-   BITMAPINFO MyBMInfo = { 0 };
+// Compile-time specialized prepareLedColors() for a fixed layout. The zone offset and the brightness weight of
+// every LED are generated at compile time from the layout, and the kernel is unrolled over all LEDs, so neither
+// the zone addressing nor the corner checks are left for run time.
+template <unsigned int numLeds>
+struct ledKernelTable {
+   unsigned int offset[numLeds]; // Offset of the LED zone in the 32bpp bottom-up zone bitmap
+   float weight[numLeds];        // Corner zones light 2 LEDs, 0.5 - same as brightnessNormalizationCoef
+};
 
-   MyBMInfo.bmiHeader.biSize = sizeof(MyBMInfo.bmiHeader);
+// Same LED order as prepareLedColors() - bottom, right, top, left side
+template <unsigned int numHorisontal, unsigned int numVertical>
+constexpr ledKernelTable<(numHorisontal + numVertical) * 2> makeLedKernelTable()
+{
+   ledKernelTable<(numHorisontal + numVertical) * 2> table = {};
+   unsigned int led = 0;
+   int x = 0, y = 0;
 
-   // Get the BITMAPINFO structure from the bitmap
-   if (0 == GetDIBits(hDC, hBitmap, 0, 0, NULL, &MyBMInfo, DIB_RGB_COLORS))
+   //Bottom side
+   for (x = 0; x < (int)numHorisontal; x++, led++)
    {
-      // error handling
-      printf("Error!!! GetDIBits (initial) failed\n");
-      gLeds.clearLeds();
-      gExitProgram = TRUE;
+      table.offset[led] = x * NUM_VALUES_PER_WIN_PIXEL;
+      table.weight[led] = ((x == 0) || (x == numHorisontal - 1)) ? 0.5f : 1.0f;
    }
 
-   MyBMInfo.bmiHeader.biBitCount = 32;
-   MyBMInfo.bmiHeader.biCompression = BI_RGB;  // no compression -> easier to use
-   MyBMInfo.bmiHeader.biHeight = abs(MyBMInfo.bmiHeader.biHeight); // correct the bottom-up ordering of lines
-
-   // create the pixel buffer
-   BYTE* lpPixels = new BYTE[MyBMInfo.bmiHeader.biSizeImage];
-   BYTE* finalPixals = new BYTE[leds::totalNumBytesToSend];
-
-   while (!gExitProgram)
+   //Right side
+   for (y = 0; y < (int)numVertical; y++, led++)
    {
-      if (!gLeds.isConnected())
-      {
-         //Exit to outer loop and wait there for leds to reconnect
-         break;
-      }
-
-      if ((gScreen.curEdges.top >= gScreen.res.height) || (gScreen.curEdges.bottom >= gScreen.res.height) || (gScreen.curEdges.top >= gScreen.curEdges.bottom)
-         || (gScreen.curEdges.right >= gScreen.res.width) || (gScreen.curEdges.left > gScreen.res.width) || (gScreen.curEdges.left >= gScreen.curEdges.right))
-      {
-         printf("Error!!! wrong edges...\n");
+      table.offset[led] = (numHorisontal - 1 + y * numHorisontal) * NUM_VALUES_PER_WIN_PIXEL;
+      table.weight[led] = ((y == 0) || (y == numVertical - 1)) ? 0.5f : 1.0f;
+   }
 
-         gLeds.clearLeds();
-         gExitProgram = TRUE;
-         break;
-      }
-      
-      SetStretchBltMode(hDC, HALFTONE);
-      BOOL bRet = StretchBlt(hDC, 0, 0, MyBMInfo.bmiHeader.biWidth, MyBMInfo.bmiHeader.biHeight, hScreen, gScreen.curEdges.left, gScreen.curEdges.top, (gScreen.curEdges.right - gScreen.curEdges.left + 1), (gScreen.curEdges.bottom - gScreen.curEdges.top + 1), SRCCOPY);
-      if (!bRet)
-      {
-         printf("Error!!! StretchBlt failed\n");
+   //Top side
+   for (x = numHorisontal - 1; x >= 0; x--, led++)
+   {
+      table.offset[led] = (x + (numVertical - 1) * numHorisontal) * NUM_VALUES_PER_WIN_PIXEL;
+      table.weight[led] = ((x == 0) || (x == numHorisontal - 1)) ? 0.5f : 1.0f;
+   }
 
-         gLeds.clearLeds();
-         gExitProgram = TRUE;
-         break;
-      }
+   //Left side
+   for (y = numVertical - 1; y >= 0; y--, led++)
+   {
+      table.offset[led] = (y * numHorisontal) * NUM_VALUES_PER_WIN_PIXEL;
+      table.weight[led] = ((y == 0) || (y == numVertical - 1)) ? 0.5f : 1.0f;
+   }
 
-#ifdef SAVE_BITMAP_TO_CLIPBOARD
-      // save bitmap to clipboard
-      OpenClipboard(NULL);
-      EmptyClipboard();
-      SetClipboardData(CF_BITMAP, hBitmap);
-      CloseClipboard();
-#endif // SAVE_BITMAP_TO_CLIPBOARD
+   return table;
+}
 
-      // Call GetDIBits a second time, this time to (format and) store the actual
-      // bitmap data (the "pixels") in the buffer lpPixels
-      if (0 == GetDIBits(hDC, hBitmap, 0, MyBMInfo.bmiHeader.biHeight, lpPixels, &MyBMInfo, DIB_RGB_COLORS))
-      {
-         // error handling
-         printf("Error!!! GetDIBits failed\n");
+template <unsigned int numHorisontal, unsigned int numVertical>
+class fixedLedKernel {
+public:
+   static const unsigned int numLeds = (numHorisontal + numVertical) * 2;
+   static constexpr ledKernelTable<numLeds> table = makeLedKernelTable<numHorisontal, numVertical>();
 
-         gLeds.clearLeds();
-         gExitProgram = TRUE;
-         break;
-      }
+   static void prepareLedColors(BYTE *finalPixals, const BYTE* lpPixels, const float bCoef);
+};
 
-      // prepare all LED colors
-      prepareLedColors(finalPixals, lpPixels, &MyBMInfo);
+template <unsigned int numHorisontal, unsigned int numVertical>
+constexpr ledKernelTable<fixedLedKernel<numHorisontal, numVertical>::numLeds> fixedLedKernel<numHorisontal, numVertical>::table;
 
-      gLeds.setLeds(finalPixals, leds::totalNumBytesToSend);
-      
-      Sleep(1); // Sleep 1mSec just to yield the thread
+// Unrolls the kernel over LEDs [first, first + count), split in halves to keep the template nesting shallow
+template <class kernel, unsigned int first, unsigned int count>
+struct fixedLedKernelUnroll {
+   static inline void run(BYTE *finalPixals, const BYTE* lpPixels, const float bCoef) {
+      fixedLedKernelUnroll<kernel, first, count / 2>::run(finalPixals, lpPixels, bCoef);
+      fixedLedKernelUnroll<kernel, first + count / 2, count - count / 2>::run(finalPixals, lpPixels, bCoef);
    }
+};
 
-   printf("Capture loop is finished...\n");
+template <class kernel, unsigned int first>
+struct fixedLedKernelUnroll<kernel, first, 1> {
+   static inline void run(BYTE *finalPixals, const BYTE* lpPixels, const float bCoef) {
+      constexpr unsigned int offset = kernel::table.offset[first];
+      constexpr float weight = kernel::table.weight[first];
 
-   // clean up
-   delete[] lpPixels;
-   delete[] finalPixals;
-   DeleteObject(hBitmap);
-   DeleteDC(hDC);
-   ReleaseDC(NULL, hScreen);
+      translateWin2LedPixel(&lpPixels[offset], &finalPixals[first * ledLayout::numValuesPerPixel], bCoef, weight);
+   }
+};
 
-   gLeds.clearLeds();
-}
+template <class kernel, unsigned int first>
+struct fixedLedKernelUnroll<kernel, first, 0> {
+   static inline void run(BYTE *finalPixals, const BYTE* lpPixels, const float bCoef) {}
+};
 
-void leds::runLedTest()
+template <unsigned int numHorisontal, unsigned int numVertical>
+void fixedLedKernel<numHorisontal, numVertical>::prepareLedColors(BYTE *finalPixals, const BYTE* lpPixels, const float bCoef)
 {
-   setSolidColor(255, 0, 0);
-   Sleep(250);
-   setSolidColor(0, 255, 0);
-   Sleep(250);
-   setSolidColor(0, 0, 255);
-   Sleep(250);
-   clearLeds();
-   Sleep(250);
+   fixedLedKernelUnroll<fixedLedKernel<numHorisontal, numVertical>, 0, numLeds>::run(finalPixals, lpPixels, bCoef);
 }
 
-BOOL CtrlHandler(DWORD fdwCtrlType)
-{
-   gExitProgram = TRUE;
-   return TRUE;
-}
+typedef void (*fixedLedKernelFunc)(BYTE *finalPixals, const BYTE* lpPixels, const float bCoef);
 
-///////////////////////////////////////////////////////////////////////////////////
-// Thread routines
-///////////////////////////////////////////////////////////////////////////////////
+struct fixedLedKernelEntry {
+   unsigned int numHorisontal, numVertical;
+   fixedLedKernelFunc prepareLedColors;
+};
+
+// Layouts with a specialized kernel, add the layouts of gLedDeviceConfigs here. Other layouts use prepareLedColors().
+const fixedLedKernelEntry gFixedLedKernels[] = {
+   { 28, 16, fixedLedKernel<28, 16>::prepareLedColors },
+   { 20, 2,  fixedLedKernel<20, 2>::prepareLedColors },
+};
 
-DWORD WINAPI detectScreenEdgesThread(LPVOID lpParam)
+// Specialized kernel of the layout, NULL if there is none
+fixedLedKernelFunc getFixedLedKernel(const ledLayout &layout)
 {
-   printf("Screen edge detection thread started - detection interval is %d [Sec]\n", gEdgeDetectionCheckIntervalSec);
+   unsigned int i;
 
-   while (!gExitProgram)
-   {
-      if (gLeds.isConnected())
-      {
-         gScreen.res.update();
-         if (edgeDetection_enable)
-         {
-            gScreen.detectEdges();
-         }
-         else
-         {
-            gScreen.setDefaultEdges();
-         }
-      }
+   if (!fixedLedKernels_enable)
+      return NULL;
 
-      Sleep(gEdgeDetectionCheckIntervalSec * SEC_TO_MSEC);
+   for (i = 0; i < sizeof(gFixedLedKernels) / sizeof(gFixedLedKernels[0]); i++)
+   {
+      if ((gFixedLedKernels[i].numHorisontal == layout.numHorisontal) && (gFixedLedKernels[i].numVertical == layout.numVertical))
+         return gFixedLedKernels[i].prepareLedColors;
    }
 
-   return 0;
+   return NULL;
 }
 
-DWORD WINAPI captureThread(LPVOID lpParam)
+zoneAverager::zoneAverager(BOOL isLinearLight)
 {
-   printf("main capture thread started\n");
+   unsigned int i;
 
-   while (!gExitProgram)
+   if (!isLinearLight)
    {
-      Sleep(100);
+      // Plain average of the sRGB values, the 16 bit value is the byte repeated (0xFF -> 0xFFFF)
+      for (i = 0; i < 256; i++)
+      {
+         decodeTable[i] = (UINT16)(i * 257);
+      }
 
-      if (gLeds.isConnected())
+      for (i = 0; i < encodeTableSize; i++)
       {
-         captureLoop();
+         encodeTable[i] = (BYTE)(((i << encodeTableShift) + (1 << (encodeTableShift - 1)) + 128) / 257); // Rounded, so every byte maps back to itself
       }
+      return;
    }
 
-   return 0;
+   // sRGB -> linear (IEC 61966-2-1 transfer function)
+   for (i = 0; i < 256; i++)
+   {
+      double c = (double)i / MAXBYTE;
+      double linear = (c <= 0.04045) ? (c / 12.92) : pow((c + 0.055) / 1.055, 2.4);
+
+      decodeTable[i] = (UINT16)(linear * 0xFFFF + 0.5);
+   }
+
+   // linear -> sRGB, indexed by the top bits of the 16 bit linear value
+   for (i = 0; i < encodeTableSize; i++)
+   {
+      double linear = ((double)(i << encodeTableShift) + (1 << (encodeTableShift - 1))) / 0xFFFF;
+      double c = (linear <= 0.0031308) ? (linear * 12.92) : (1.055 * pow(linear, 1.0 / 2.4) - 0.055);
+
+      if (c > 1.0) c = 1.0;
+      encodeTable[i] = (BYTE)(c * MAXBYTE + 0.5);
+   }
 }
 
-DWORD WINAPI serialConnectionThread(LPVOID lpParam)
+// Sums the decoded linear values of all pixels in [x0, x1) x [y0, y1), sums[] is in BGR order
+void zoneAverager::sumZone(const BYTE* lpPixels, int stride, unsigned int x0, unsigned int x1, unsigned int y0, unsigned int y1, ULONGLONG* sums) const
 {
-   BOOL allowFastReconnect = FALSE;
+   unsigned int x, y;
 
-   while (!gExitProgram)
+   sums[0] = 0;
+   sums[1] = 0;
+   sums[2] = 0;
+
+   for (y = y0; y < y1; y++)
    {
-      if (!gLeds.isConnected())
-      {
-         gLeds.tryConnect(!allowFastReconnect);
+      const BYTE* row = lpPixels + ((int)y * stride + (int)x0) * NUM_VALUES_PER_WIN_PIXEL;
+      unsigned int numPixels = x1 - x0;
+      x = 0;
 
-         allowFastReconnect = FALSE;
+#ifdef USE_SSE2
+      // Two pixels per iteration: decode into 8 x 16 bit lanes (alpha lanes are zeroed), widen to
+      // 32 bit and accumulate. A row of 16 bit values can't overflow the 32 bit lanes.
+      __m128i zero = _mm_setzero_si128();
+      __m128i acc = _mm_setzero_si128();
+
+      for (; x + 2 <= numPixels; x += 2)
+      {
+         const BYTE* p = &row[x * NUM_VALUES_PER_WIN_PIXEL];
+         __m128i decoded = _mm_setr_epi16(decodeTable[p[0]], decodeTable[p[1]], decodeTable[p[2]], 0,
+                                          decodeTable[p[4]], decodeTable[p[5]], decodeTable[p[6]], 0);
+
+         acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(decoded, zero));
+         acc = _mm_add_epi32(acc, _mm_unpackhi_epi16(decoded, zero));
+      }
+
+      UINT32 rowSums[4];
+      _mm_storeu_si128((__m128i*)rowSums, acc);
+      sums[0] += rowSums[0];
+      sums[1] += rowSums[1];
+      sums[2] += rowSums[2];
+#endif // USE_SSE2
+
+      for (; x < numPixels; x++)
+      {
+         const BYTE* p = &row[x * NUM_VALUES_PER_WIN_PIXEL];
+
+         sums[0] += decodeTable[p[0]];
+         sums[1] += decodeTable[p[1]];
+         sums[2] += decodeTable[p[2]];
+      }
+   }
+}
+
+void zoneAverager::average(const BYTE* lpPixels, int stride, unsigned int width, unsigned int height, BYTE* zonePixel) const
+{
+   unsigned int color;
+   ULONGLONG sums[3];
+   ULONGLONG numPixels = (ULONGLONG)width * height;
+
+   if (numPixels == 0)
+   {
+      memset(zonePixel, 0, NUM_VALUES_PER_WIN_PIXEL);
+      return;
+   }
+
+   sumZone(lpPixels, stride, 0, width, 0, height, sums);
+
+   for (color = 0; color < 3; color++)
+   {
+      zonePixel[color] = encodeTable[(sums[color] / numPixels) >> encodeTableShift];
+   }
+   zonePixel[3] = 0;
+}
+
+BOOL gdiRegionBuffer::resize(HDC hScreen, unsigned int newWidth, unsigned int newHeight)
+{
+   release();
+
+   hDC = CreateCompatibleDC(hScreen);
+   hBitmap = CreateCompatibleBitmap(hScreen, newWidth, newHeight);
+   if ((hDC == NULL) || (hBitmap == NULL))
+   {
+      release();
+      return FALSE;
+   }
+   SelectObject(hDC, hBitmap);
+
+   bmInfo = { 0 };
+   bmInfo.bmiHeader.biSize = sizeof(bmInfo.bmiHeader);
+   bmInfo.bmiHeader.biWidth = newWidth;
+   bmInfo.bmiHeader.biHeight = newHeight; // positive height -> bottom-up ordering of lines, same as the LED bitmap
+   bmInfo.bmiHeader.biPlanes = 1;
+   bmInfo.bmiHeader.biBitCount = 32;
+   bmInfo.bmiHeader.biCompression = BI_RGB;
+   bmInfo.bmiHeader.biSizeImage = newWidth * newHeight * NUM_VALUES_PER_WIN_PIXEL;
+
+   lpPixels = new BYTE[bmInfo.bmiHeader.biSizeImage];
+   width = newWidth;
+   height = newHeight;
+
+   return TRUE;
+}
+
+void gdiRegionBuffer::release()
+{
+   delete[] lpPixels;
+   lpPixels = NULL;
+   width = 0;
+   height = 0;
+
+   if (hBitmap != NULL)
+   {
+      DeleteObject(hBitmap);
+      hBitmap = NULL;
+   }
+
+   if (hDC != NULL)
+   {
+      DeleteDC(hDC);
+      hDC = NULL;
+   }
+}
+
+BOOL gdiFrameSource::open()
+{
+   if (hScreen == NULL)
+   {
+      hScreen = GetDC(NULL);
+   }
+
+   return (hScreen != NULL);
+}
+
+void gdiFrameSource::close()
+{
+   unsigned int i;
+
+   for (i = 0; i < maxNumRegions; i++)
+   {
+      regions[i].release();
+   }
+
+   if (hScreen != NULL)
+   {
+      ReleaseDC(NULL, hScreen);
+      hScreen = NULL;
+   }
+}
+
+captureResult gdiFrameSource::captureRegions(regionRequest *requests, unsigned int numRequests)
+{
+   unsigned int i;
+
+   for (i = 0; (i < numRequests) && (i < maxNumRegions); i++)
+   {
+      regionRequest *request = &requests[i];
+      gdiRegionBuffer *region = &regions[i];
+      unsigned int width = request->area.right - request->area.left + 1;
+      unsigned int height = request->area.bottom - request->area.top + 1;
+
+      if ((width != region->width) || (height != region->height))
+      {
+         if (!region->resize(hScreen, width, height))
+         {
+            printf("Error!!! gdiFrameSource: failed to allocate %dx%d bitmap\n", width, height);
+            return CAPTURE_FAILED;
+         }
+      }
+
+      if (!BitBlt(region->hDC, 0, 0, width, height, hScreen, request->area.left, request->area.top, SRCCOPY))
+      {
+         printf("Error!!! gdiFrameSource: BitBlt failed\n");
+         return CAPTURE_FAILED;
+      }
+
+      if (request->readPixels && !region->readPixels())
+      {
+         printf("Error!!! gdiFrameSource: GetDIBits failed\n");
+         return CAPTURE_FAILED;
+      }
+
+      request->frame.area = request->area;
+      request->frame.hDC = region->hDC;
+      request->frame.lpPixels = request->readPixels ? region->lpPixels : NULL;
+      request->frame.stride = width;
+
+      numCapturedBytes += (unsigned long long)width * height * NUM_VALUES_PER_WIN_PIXEL;
+   }
+
+   return (i == numRequests) ? CAPTURE_OK : CAPTURE_FAILED;
+}
+
+BOOL sharedMemoryFrameSource::open()
+{
+   if (header != NULL)
+   {
+      return TRUE;
+   }
+
+   hMapping = OpenFileMapping(FILE_MAP_READ, FALSE, mappingName);
+   if (hMapping == NULL)
+   {
+      return FALSE; // No producer (yet)
+   }
+
+   header = (const ambilightSharedFrameHeader*)MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+   if (header == NULL)
+   {
+      close();
+      return FALSE;
+   }
+
+   MEMORY_BASIC_INFORMATION viewInfo;
+   if ((VirtualQuery(header, &viewInfo, sizeof(viewInfo)) == 0) || (viewInfo.RegionSize < sizeof(ambilightSharedFrameHeader)))
+   {
+      if (isFirstError())
+      {
+         printf("Error!!! shared memory frames: mapping is smaller than the header\n");
+      }
+      close();
+      return FALSE;
+   }
+
+   // Take the generation first, a producer that restarts in the middle of open() is noticed on the next frame
+   generation = header->generation;
+   MemoryBarrier();
+
+   if (header->magic == 0)
+   {
+      close();
+      return FALSE; // The producer is (re)writing the header
+   }
+
+   if ((header->magic != AMBILIGHT_SHARED_FRAME_MAGIC) || (header->version != AMBILIGHT_SHARED_FRAME_VERSION)
+      || (header->format != AMBILIGHT_SHARED_FRAME_FORMAT_BGRA32))
+   {
+      if (isFirstError())
+      {
+         printf("Error!!! shared memory frames: unsupported header (magic 0x%x, version %d, format %d)\n", header->magic, header->version, header->format);
+      }
+      close();
+      return FALSE;
+   }
+
+   // Take the geometry once, the producer may change the header at any time
+   UINT32 headerSize = header->headerSize;
+   width = header->width;
+   height = header->height;
+   stride = header->stride;
+   slotSize = header->slotSize;
+   numSlots = header->numSlots;
+   isBottomUp = (header->isBottomUp != 0);
+
+   if ((width == 0) || (height == 0) || (numSlots == 0) || (numSlots > AMBILIGHT_SHARED_FRAME_NUM_SLOTS)
+      || (headerSize < sizeof(ambilightSharedFrameHeader)) || (stride % NUM_VALUES_PER_WIN_PIXEL != 0)
+      || ((ULONGLONG)stride < (ULONGLONG)width * NUM_VALUES_PER_WIN_PIXEL) || ((ULONGLONG)stride * height > MAXINT32)
+      || ((ULONGLONG)slotSize < (ULONGLONG)stride * height)
+      || ((ULONGLONG)headerSize + (ULONGLONG)numSlots * slotSize > viewInfo.RegionSize))
+   {
+      if (isFirstError())
+      {
+         printf("Error!!! shared memory frames: frame geometry doesn't fit the mapping (%dx%d, stride %d, %d slots of %d bytes)\n",
+            width, height, stride, numSlots, slotSize);
+      }
+      close();
+      return FALSE;
+   }
+
+   slots = (const BYTE*)header + headerSize;
+   printf("Shared memory frames: %dx%d, %d slots\n", width, height, numSlots);
+
+   return TRUE;
+}
+
+void sharedMemoryFrameSource::close()
+{
+   if (header != NULL)
+   {
+      UnmapViewOfFile(header);
+      header = NULL;
+      slots = NULL;
+   }
+
+   if (hMapping != NULL)
+   {
+      CloseHandle(hMapping);
+      hMapping = NULL;
+   }
+}
+
+captureResult sharedMemoryFrameSource::captureRegions(regionRequest *requests, unsigned int numRequests)
+{
+   LONG64 latestFrame;
+   const BYTE* slotPixels;
+   frameView fullFrame;
+   unsigned int i, retry;
+
+   if ((header != NULL) && (header->generation != generation))
+   {
+      // The producer was restarted, take its new header and let the capture loop check the resolution again
+      printf("Shared memory frames: producer restarted\n");
+      close();
+      open();
+      return CAPTURE_SKIP_FRAME;
+   }
+
+   if ((header == NULL) && !open())
+   {
+      return CAPTURE_SKIP_FRAME;
+   }
+
+   for (retry = 0; retry < numSlots; retry++)
+   {
+      latestFrame = header->latestFrame;
+      curSlot = (UINT32)((ULONGLONG)latestFrame % numSlots);
+      curSlotSequence = header->slotSequence[curSlot];
+      MemoryBarrier();
+
+      if ((curSlotSequence & 1) == 0)
+         break; // Not being written
+   }
+
+   if ((curSlotSequence & 1) != 0)
+   {
+      return CAPTURE_SKIP_FRAME; // The producer is writing, the next frame will be complete
+   }
+
+   // The whole frame is already in memory, every region is a view into it
+   slotPixels = slots + (ULONGLONG)curSlot * slotSize;
+   fullFrame.area.left = 0;
+   fullFrame.area.top = 0;
+   fullFrame.area.right = width - 1;
+   fullFrame.area.bottom = height - 1;
+
+   if (isBottomUp)
+   {
+      fullFrame.lpPixels = slotPixels;
+      fullFrame.stride = stride / NUM_VALUES_PER_WIN_PIXEL;
+   }
+   else
+   {
+      fullFrame.lpPixels = slotPixels + (ULONGLONG)(height - 1) * stride;
+      fullFrame.stride = -(int)(stride / NUM_VALUES_PER_WIN_PIXEL);
+   }
+
+   for (i = 0; i < numRequests; i++)
+   {
+      if ((requests[i].area.right > fullFrame.area.right) || (requests[i].area.bottom > fullFrame.area.bottom))
+      {
+         if (isFirstError())
+         {
+            printf("Error!!! shared memory frames: region is out of the frame\n");
+         }
+         return CAPTURE_SKIP_FRAME;
+      }
+
+      requests[i].frame.area = requests[i].area;
+      requests[i].frame.hDC = NULL;
+      requests[i].frame.lpPixels = fullFrame.getAreaPixels(requests[i].area);
+      requests[i].frame.stride = fullFrame.stride;
+
+      numCapturedBytes += (unsigned long long)requests[i].frame.width() * requests[i].frame.height() * NUM_VALUES_PER_WIN_PIXEL;
+   }
+
+   isErrorReported = FALSE;
+   return CAPTURE_OK;
+}
+
+BOOL sharedMemoryFrameSource::isFrameStillValid()
+{
+   MemoryBarrier();
+   return (header->slotSequence[curSlot] == curSlotSequence);
+}
+
+rawFileFrameSource::rawFileFrameSource(const char *fileName, unsigned int width, unsigned int height, unsigned int fps)
+{
+   unsigned int i;
+
+   this->fileName = fileName;
+   this->width = width;
+   this->height = height;
+   this->fps = fps;
+   hFile = INVALID_HANDLE_VALUE;
+   numFrames = 0;
+   curFrame = 0;
+
+   for (i = 0; i < maxNumRegions; i++)
+   {
+      regionPixels[i] = NULL;
+      regionBufferSize[i] = 0;
+   }
+}
+
+rawFileFrameSource::~rawFileFrameSource()
+{
+   unsigned int i;
+
+   close();
+
+   for (i = 0; i < maxNumRegions; i++)
+   {
+      delete[] regionPixels[i];
+   }
+}
+
+BOOL rawFileFrameSource::open()
+{
+   LARGE_INTEGER fileSize;
+
+   if (hFile != INVALID_HANDLE_VALUE)
+   {
+      return TRUE;
+   }
+
+   hFile = CreateFileA(fileName, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+   if (hFile == INVALID_HANDLE_VALUE)
+   {
+      printf("Error!!! raw file: can't open %s\n", fileName);
+      return FALSE;
+   }
+
+   if (!GetFileSizeEx(hFile, &fileSize) || (width == 0) || (height == 0))
+   {
+      close();
+      return FALSE;
+   }
+
+   numFrames = fileSize.QuadPart / ((ULONGLONG)width * height * NUM_VALUES_PER_WIN_PIXEL);
+   if (numFrames == 0)
+   {
+      printf("Error!!! raw file: %s is smaller than a single %dx%d frame\n", fileName, width, height);
+      close();
+      return FALSE;
+   }
+
+   printf("Raw file: %s, %dx%d, %llu frames\n", fileName, width, height, numFrames);
+   curFrame = 0;
+   startTime = std::chrono::high_resolution_clock::now();
+
+   return TRUE;
+}
+
+void rawFileFrameSource::close()
+{
+   if (hFile != INVALID_HANDLE_VALUE)
+   {
+      CloseHandle(hFile);
+      hFile = INVALID_HANDLE_VALUE;
+   }
+}
+
+BOOL rawFileFrameSource::readRegion(ULONGLONG frameOffset, regionRequest *request, unsigned int index)
+{
+   unsigned int regionWidth = request->area.right - request->area.left + 1;
+   unsigned int regionHeight = request->area.bottom - request->area.top + 1;
+   unsigned int lineSize = regionWidth * NUM_VALUES_PER_WIN_PIXEL;
+   unsigned int regionSize = lineSize * regionHeight;
+   LARGE_INTEGER offset;
+   DWORD bytesRead;
+   unsigned int y;
+
+   if ((request->area.right >= width) || (request->area.bottom >= height))
+   {
+      if (isFirstError())
+      {
+         printf("Error!!! raw file: region is out of the frame\n");
+      }
+      return FALSE;
+   }
+
+   if (regionSize > regionBufferSize[index])
+   {
+      delete[] regionPixels[index];
+      regionPixels[index] = new BYTE[regionSize];
+      regionBufferSize[index] = regionSize;
+   }
+
+   offset.QuadPart = frameOffset + ((ULONGLONG)request->area.top * width + request->area.left) * NUM_VALUES_PER_WIN_PIXEL;
+
+   if (regionWidth == width)
+   {
+      // Full lines are contiguous in the file
+      if (!SetFilePointerEx(hFile, offset, NULL, FILE_BEGIN)
+         || !ReadFile(hFile, regionPixels[index], regionSize, &bytesRead, NULL) || (bytesRead != regionSize))
+      {
+         return FALSE;
+      }
+   }
+   else
+   {
+      for (y = 0; y < regionHeight; y++)
+      {
+         if (!SetFilePointerEx(hFile, offset, NULL, FILE_BEGIN)
+            || !ReadFile(hFile, &regionPixels[index][y * lineSize], lineSize, &bytesRead, NULL) || (bytesRead != lineSize))
+         {
+            return FALSE;
+         }
+
+         offset.QuadPart += (ULONGLONG)width * NUM_VALUES_PER_WIN_PIXEL;
+      }
+   }
+
+   // The file is top-down, the view starts from the bottom line
+   request->frame.area = request->area;
+   request->frame.hDC = NULL;
+   request->frame.lpPixels = &regionPixels[index][(regionHeight - 1) * lineSize];
+   request->frame.stride = -(int)regionWidth;
+
+   numCapturedBytes += regionSize;
+   return TRUE;
+}
+
+captureResult rawFileFrameSource::captureRegions(regionRequest *requests, unsigned int numRequests)
+{
+   unsigned int i;
+
+   if (fps != 0)
+   {
+      // Play in real time
+      auto elapsed = std::chrono::high_resolution_clock::now() - startTime;
+      curFrame = (std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count() * fps / (MSEC_TO_USEC * SEC_TO_MSEC)) % numFrames;
+   }
+   else
+   {
+      curFrame = (curFrame + 1) % numFrames;
+   }
+
+   ULONGLONG frameOffset = curFrame * width * height * NUM_VALUES_PER_WIN_PIXEL;
+
+   for (i = 0; (i < numRequests) && (i < maxNumRegions); i++)
+   {
+      if (!readRegion(frameOffset, &requests[i], i))
+      {
+         if (isFirstError())
+         {
+            printf("Error!!! raw file: failed to read frame %llu\n", curFrame);
+         }
+         return CAPTURE_SKIP_FRAME;
+      }
+   }
+
+   isErrorReported = FALSE;
+   return (i == numRequests) ? CAPTURE_OK : CAPTURE_FAILED;
+}
+
+yuvFileFrameSource::yuvFileFrameSource(const char *fileName, BOOL isY4m, unsigned int width, unsigned int height, yuvFormat format, int fps)
+{
+   unsigned int i;
+
+   this->fileName = fileName;
+   this->isY4m = isY4m;
+   this->width = width;
+   this->height = height;
+   this->format = format;
+   this->fps = fps;
+   coefRV = coefGU = coefGV = coefBU = 0;
+   hFile = INVALID_HANDLE_VALUE;
+   firstFrameOffset.QuadPart = 0;
+   frameSize = 0;
+   hReaderThread = NULL;
+   hFrameReadEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+   hSlotFreeEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+   numFramesRead = 0;
+   curFrame = 0;
+   isReaderStopping = FALSE;
+   isFirstCapture = TRUE;
+
+   for (i = 0; i < numReadAheadFrames; i++)
+   {
+      frameBuffers[i] = NULL;
+   }
+
+   for (i = 0; i < maxNumRegions; i++)
+   {
+      regionPixels[i] = NULL;
+      regionBufferSize[i] = 0;
+   }
+}
+
+yuvFileFrameSource::~yuvFileFrameSource()
+{
+   unsigned int i;
+
+   close();
+   CloseHandle(hFrameReadEvent);
+   CloseHandle(hSlotFreeEvent);
+
+   for (i = 0; i < numReadAheadFrames; i++)
+   {
+      delete[] frameBuffers[i];
+   }
+
+   for (i = 0; i < maxNumRegions; i++)
+   {
+      delete[] regionPixels[i];
+   }
+}
+
+// "YUV4MPEG2 W1920 H1080 F30000:1001 Ip A1:1 C420jpeg\n" - only the size, the frame rate and the color space are used
+// header - buffer of maxY4mHeaderSize + 1 bytes
+BOOL yuvFileFrameSource::parseY4mHeader(char *header)
+{
+   DWORD bytesRead;
+   char *token, *context = NULL;
+   unsigned int headerLength;
+
+   if (!ReadFile(hFile, header, maxY4mHeaderSize, &bytesRead, NULL))
+   {
+      return FALSE;
+   }
+   header[bytesRead] = '\0';
+
+   char *lineEnd = strchr(header, '\n');
+   if ((lineEnd == NULL) && (bytesRead == maxY4mHeaderSize) && (strncmp(header, "YUV4MPEG2 ", 10) == 0))
+   {
+      printf("Error!!! Y4M file: %s has a header longer than %d bytes\n", fileName, maxY4mHeaderSize);
+      return FALSE;
+   }
+
+   if ((lineEnd == NULL) || (strncmp(header, "YUV4MPEG2 ", 10) != 0))
+   {
+      printf("Error!!! Y4M file: %s has no valid header\n", fileName);
+      return FALSE;
+   }
+   *lineEnd = '\0';
+   headerLength = (unsigned int)(lineEnd - header) + 1;
+
+   width = 0;
+   height = 0;
+   format = YUV_FORMAT_I420;
+   for (token = strtok_s(header + 10, " ", &context); token != NULL; token = strtok_s(NULL, " ", &context))
+   {
+      switch (token[0])
+      {
+      case 'W':
+         width = atoi(token + 1);
+         break;
+      case 'H':
+         height = atoi(token + 1);
+         break;
+      case 'F':
+         if (fps < 0)
+         {
+            unsigned int num = 0, den = 0;
+            sscanf_s(token + 1, "%u:%u", &num, &den);
+            fps = (den != 0) ? (int)((num + den / 2) / den) : 0;
+         }
+         break;
+      case 'C':
+         // 8 bit 4:2:0 only, high bit depth tags (C420p10...) have 2 bytes per sample
+         if ((strcmp(token, "C420") != 0) && (strcmp(token, "C420jpeg") != 0)
+            && (strcmp(token, "C420paldv") != 0) && (strcmp(token, "C420mpeg2") != 0))
+         {
+            printf("Error!!! Y4M file: color space %s is not supported, only 4:2:0\n", token + 1);
+            return FALSE;
+         }
+         break;
+      }
+   }
+
+   // Frames start right after the header line
+   firstFrameOffset.QuadPart = headerLength;
+   return (width > 0) && (height > 0);
+}
+
+BOOL yuvFileFrameSource::open()
+{
+   DWORD dwThreadId;
+   unsigned int i;
+
+   if (hFile != INVALID_HANDLE_VALUE)
+   {
+      return TRUE;
+   }
+
+   hFile = CreateFileA(fileName, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+   if (hFile == INVALID_HANDLE_VALUE)
+   {
+      printf("Error!!! YUV file: can't open %s\n", fileName);
+      return FALSE;
+   }
+
+   firstFrameOffset.QuadPart = 0;
+   if (isY4m)
+   {
+      char *header = new char[maxY4mHeaderSize + 1];
+      BOOL isHeaderValid = parseY4mHeader(header);
+
+      delete[] header;
+      if (!isHeaderValid)
+      {
+         close();
+         return FALSE;
+      }
+   }
+
+   if (fps < 0)
+   {
+      fps = 0;
+   }
+
+   if ((width == 0) || (height == 0))
+   {
+      close();
+      return FALSE;
+   }
+
+   // SD content is BT.601, HD is BT.709
+   if (height >= 720)
+   {
+      coefRV = 459; coefGU = 55; coefGV = 136; coefBU = 541;
+   }
+   else
+   {
+      coefRV = 409; coefGU = 100; coefGV = 208; coefBU = 516;
+   }
+
+   unsigned int newFrameSize = width * height + 2 * ((width + 1) / 2) * ((height + 1) / 2);
+   if (newFrameSize != frameSize)
+   {
+      for (i = 0; i < numReadAheadFrames; i++)
+      {
+         delete[] frameBuffers[i];
+         frameBuffers[i] = new BYTE[newFrameSize];
+      }
+      frameSize = newFrameSize;
+   }
+
+   printf("YUV file: %s, %dx%d %s, %d fps\n", fileName, width, height, (format == YUV_FORMAT_NV12) ? "NV12" : "I420", fps);
+
+   SetFilePointerEx(hFile, firstFrameOffset, NULL, FILE_BEGIN);
+   numFramesRead = 0;
+   curFrame = 0;
+   isReaderStopping = FALSE;
+   isFirstCapture = TRUE;
+   ResetEvent(hFrameReadEvent);
+   ResetEvent(hSlotFreeEvent);
+
+   hReaderThread = CreateThread(NULL, 0, readerThread, this, 0, &dwThreadId);
+   if (hReaderThread == NULL)
+   {
+      printf("Error!!! YUV file: reader thread failed, error: %d\n", GetLastError());
+      close();
+      return FALSE;
+   }
+
+   return TRUE;
+}
+
+void yuvFileFrameSource::close()
+{
+   if (hReaderThread != NULL)
+   {
+      isReaderStopping = TRUE;
+      SetEvent(hSlotFreeEvent);
+      WaitForSingleObject(hReaderThread, INFINITE);
+      CloseHandle(hReaderThread);
+      hReaderThread = NULL;
+   }
+
+   if (hFile != INVALID_HANDLE_VALUE)
+   {
+      CloseHandle(hFile);
+      hFile = INVALID_HANDLE_VALUE;
+   }
+}
+
+// Reads the next frame of the clip, starting over at the end of the file
+BOOL yuvFileFrameSource::readFrame(BYTE* frame)
+{
+   DWORD bytesRead;
+   unsigned int attempt;
+
+   for (attempt = 0; attempt < 2; attempt++)
+   {
+      BOOL isRead = TRUE;
+
+      if (isY4m)
+      {
+         // "FRAME" optionally followed by parameters, up to the end of the line
+         char frameHeader[6];
+         isRead = ReadFile(hFile, frameHeader, sizeof(frameHeader), &bytesRead, NULL) && (bytesRead == sizeof(frameHeader))
+            && (strncmp(frameHeader, "FRAME", 5) == 0);
+
+         char c = frameHeader[5];
+         while (isRead && (c != '\n'))
+         {
+            isRead = ReadFile(hFile, &c, 1, &bytesRead, NULL) && (bytesRead == 1);
+         }
+      }
+
+      if (isRead && ReadFile(hFile, frame, frameSize, &bytesRead, NULL) && (bytesRead == frameSize))
+      {
+         return TRUE;
+      }
+
+      SetFilePointerEx(hFile, firstFrameOffset, NULL, FILE_BEGIN);
+   }
+
+   return FALSE;
+}
+
+DWORD WINAPI yuvFileFrameSource::readerThread(LPVOID lpParam)
+{
+   ((yuvFileFrameSource*)lpParam)->readerLoop();
+   return 0;
+}
+
+void yuvFileFrameSource::readerLoop()
+{
+   while (!isReaderStopping)
+   {
+      if (numFramesRead - curFrame >= numReadAheadFrames)
+      {
+         // All buffers are ahead of the frame in use
+         WaitForSingleObject(hSlotFreeEvent, 500);
+         continue;
+      }
+
+      if (!readFrame(frameBuffers[numFramesRead % numReadAheadFrames]))
+      {
+         printf("Error!!! YUV file: %s has no complete frame\n", fileName);
+         break;
+      }
+
+      InterlockedIncrement64(&numFramesRead);
+      SetEvent(hFrameReadEvent);
+   }
+}
+
+BOOL yuvFileFrameSource::convertRegion(const BYTE* frame, regionRequest *request, unsigned int index)
+{
+   unsigned int regionWidth = request->area.right - request->area.left + 1;
+   unsigned int regionHeight = request->area.bottom - request->area.top + 1;
+   unsigned int regionSize = regionWidth * regionHeight * NUM_VALUES_PER_WIN_PIXEL;
+   unsigned int chromaWidth = (width + 1) / 2;
+   unsigned int chromaHeight = (height + 1) / 2;
+   unsigned int x, y;
+
+   if ((request->area.right >= width) || (request->area.bottom >= height))
+   {
+      if (isFirstError())
+      {
+         printf("Error!!! YUV file: region is out of the frame\n");
+      }
+      return FALSE;
+   }
+
+   if (regionSize > regionBufferSize[index])
+   {
+      delete[] regionPixels[index];
+      regionPixels[index] = new BYTE[regionSize];
+      regionBufferSize[index] = regionSize;
+   }
+
+   BYTE* pixel = regionPixels[index];
+   for (y = request->area.top; y <= request->area.bottom; y++)
+   {
+      const BYTE* lineY = frame + y * width;
+      const BYTE* lineU;
+      const BYTE* lineV;
+      unsigned int chromaStep;
+
+      if (format == YUV_FORMAT_NV12)
+      {
+         lineU = frame + width * height + (y / 2) * chromaWidth * 2;
+         lineV = lineU + 1;
+         chromaStep = 2;
+      }
+      else
+      {
+         lineU = frame + width * height + (y / 2) * chromaWidth;
+         lineV = lineU + chromaWidth * chromaHeight;
+         chromaStep = 1;
+      }
+
+      for (x = request->area.left; x <= request->area.right; x++)
+      {
+         int c = 298 * (lineY[x] - 16) + 128;
+         int d = lineU[(x / 2) * chromaStep] - 128;
+         int e = lineV[(x / 2) * chromaStep] - 128;
+         int b = (c + coefBU * d) >> 8;
+         int g = (c - coefGU * d - coefGV * e) >> 8;
+         int r = (c + coefRV * e) >> 8;
+
+         pixel[0] = (BYTE)((b < 0) ? 0 : ((b > MAXBYTE) ? MAXBYTE : b));
+         pixel[1] = (BYTE)((g < 0) ? 0 : ((g > MAXBYTE) ? MAXBYTE : g));
+         pixel[2] = (BYTE)((r < 0) ? 0 : ((r > MAXBYTE) ? MAXBYTE : r));
+         pixel[3] = 0;
+         pixel += NUM_VALUES_PER_WIN_PIXEL;
+      }
+   }
+
+   // Converted top-down, the view starts from the bottom line
+   request->frame.area = request->area;
+   request->frame.hDC = NULL;
+   request->frame.lpPixels = regionPixels[index] + (regionHeight - 1) * regionWidth * NUM_VALUES_PER_WIN_PIXEL;
+   request->frame.stride = -(int)regionWidth;
+
+   numCapturedBytes += regionSize;
+   return TRUE;
+}
+
+captureResult yuvFileFrameSource::captureRegions(regionRequest *requests, unsigned int numRequests)
+{
+   unsigned int i;
+   LONG64 targetFrame;
+
+   if (isFirstCapture)
+   {
+      if (WaitForSingleObject(hFrameReadEvent, 1000) != WAIT_OBJECT_0)
+      {
+         if (isFirstError())
+         {
+            printf("Error!!! YUV file: no frame was read\n");
+         }
+         return CAPTURE_SKIP_FRAME;
+      }
+
+      isFirstCapture = FALSE;
+      startTime = std::chrono::high_resolution_clock::now();
+   }
+
+   if (fps != 0)
+   {
+      // Play in real time, frames that are late are skipped
+      auto elapsed = std::chrono::high_resolution_clock::now() - startTime;
+      targetFrame = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count() * fps / (MSEC_TO_USEC * SEC_TO_MSEC);
+   }
+   else
+   {
+      targetFrame = curFrame + 1;
+      if (numFramesRead <= targetFrame)
+      {
+         // Reading is behind, give it a moment before showing the same frame again
+         WaitForSingleObject(hFrameReadEvent, 100);
+      }
+   }
+
+   while ((curFrame < targetFrame) && (numFramesRead > curFrame + 1))
+   {
+      InterlockedIncrement64(&curFrame);
+      SetEvent(hSlotFreeEvent);
+   }
+
+   const BYTE* frame = frameBuffers[curFrame % numReadAheadFrames];
+   for (i = 0; (i < numRequests) && (i < maxNumRegions); i++)
+   {
+      if (!convertRegion(frame, &requests[i], i))
+      {
+         return CAPTURE_SKIP_FRAME;
+      }
+   }
+
+   isErrorReported = FALSE;
+   return (i == numRequests) ? CAPTURE_OK : CAPTURE_FAILED;
+}
+
+zoneReduction::zoneReduction(const ledDeviceConfig *config) : layout(config->numHorisontal, config->numVertical)
+{
+   HDC hScreen = GetDC(NULL);
+
+   this->config = config;
+   isNeeded = FALSE;
+   isLinearLight = linearLightAveraging_enable;
+   firstRequest = 0;
+   numRequests = 0;
+
+   // Used for StretchBlt when the frame is a GDI bitmap
+   hDC = CreateCompatibleDC(hScreen);
+   hBitmap = CreateCompatibleBitmap(hScreen, layout.numHorisontal, layout.numVertical);
+   SelectObject(hDC, hBitmap);
+   ReleaseDC(NULL, hScreen);
+
+   bmInfo = { 0 };
+   bmInfo.bmiHeader.biSize = sizeof(bmInfo.bmiHeader);
+   bmInfo.bmiHeader.biWidth = layout.numHorisontal;
+   bmInfo.bmiHeader.biHeight = layout.numVertical; // positive height -> bottom-up ordering of lines
+   bmInfo.bmiHeader.biPlanes = 1;
+   bmInfo.bmiHeader.biBitCount = 32;
+   bmInfo.bmiHeader.biCompression = BI_RGB;  // no compression -> easier to use
+   bmInfo.bmiHeader.biSizeImage = layout.numHorisontal * layout.numVertical * NUM_VALUES_PER_WIN_PIXEL;
+
+   lpPixels = new BYTE[bmInfo.bmiHeader.biSizeImage];
+   memset(lpPixels, 0, bmInfo.bmiHeader.biSizeImage);
+}
+
+zoneReduction::~zoneReduction()
+{
+   delete[] lpPixels;
+   DeleteObject(hBitmap);
+   DeleteDC(hDC);
+}
+
+// Translates the crop region fractions to an area of the (edge detected) screen
+void zoneReduction::getArea(const screenEdge &screenArea, screenEdge *area) const
+{
+   unsigned int width = screenArea.right - screenArea.left + 1;
+   unsigned int height = screenArea.bottom - screenArea.top + 1;
+
+   area->left = screenArea.left + (unsigned int)(config->cropLeft * width);
+   area->right = screenArea.left + (unsigned int)(config->cropRight * width) - 1;
+   area->top = screenArea.top + (unsigned int)(config->cropTop * height);
+   area->bottom = screenArea.top + (unsigned int)(config->cropBottom * height) - 1;
+
+   // Keep the area inside the screen and at least one pixel per zone
+   if (area->right > screenArea.right)
+      area->right = screenArea.right;
+   if (area->bottom > screenArea.bottom)
+      area->bottom = screenArea.bottom;
+   if (area->right + 1 < area->left + layout.numHorisontal)
+      area->left = (area->right + 1 >= screenArea.left + layout.numHorisontal) ? (area->right + 1 - layout.numHorisontal) : screenArea.left;
+   if (area->bottom + 1 < area->top + layout.numVertical)
+      area->top = (area->bottom + 1 >= screenArea.top + layout.numVertical) ? (area->bottom + 1 - layout.numVertical) : screenArea.top;
+}
+
+// Screen area of a zone of the current frame, zy = 0 is the bottom line of zones
+void zoneReduction::getZoneArea(unsigned int zx, unsigned int zy, screenEdge *zone) const
+{
+   unsigned int width = curArea.right - curArea.left + 1;
+   unsigned int height = curArea.bottom - curArea.top + 1;
+
+   zone->left = curArea.left + zx * width / layout.numHorisontal;
+   zone->right = curArea.left + (zx + 1) * width / layout.numHorisontal - 1;
+   zone->bottom = curArea.bottom - zy * height / layout.numVertical;
+   zone->top = curArea.bottom - ((zy + 1) * height / layout.numVertical - 1);
+}
+
+// Adds the border strips of the crop region to the requests, returns the number of requests added
+unsigned int zoneReduction::addRegionRequests(const screenEdge &screenArea, regionRequest *requests, unsigned int firstRequest)
+{
+   screenEdge bottomLeftZone, topRightZone, zone;
+   unsigned int nH = layout.numHorisontal;
+   unsigned int nV = layout.numVertical;
+   regionRequest *request = &requests[firstRequest];
+
+   getArea(screenArea, &curArea);
+   this->firstRequest = firstRequest;
+   numRequests = 0;
+
+   getZoneArea(0, 0, &bottomLeftZone);
+   getZoneArea(nH - 1, nV - 1, &topRightZone);
+
+   // Bottom strip
+   request->area = curArea;
+   request->area.top = bottomLeftZone.top;
+   request++;
+   numRequests++;
+
+   // Top strip
+   if (nV > 1)
+   {
+      request->area = curArea;
+      request->area.bottom = topRightZone.bottom;
+      request++;
+      numRequests++;
+   }
+
+   // Left and right strips, without the corners which are part of the top and bottom strips
+   if (nV > 2)
+   {
+      request->area.left = curArea.left;
+      request->area.right = bottomLeftZone.right;
+      request->area.top = topRightZone.bottom + 1;
+      request->area.bottom = bottomLeftZone.top - 1;
+      request++;
+      numRequests++;
+
+      request->area.left = topRightZone.left;
+      request->area.right = curArea.right;
+      request->area.top = topRightZone.bottom + 1;
+      request->area.bottom = bottomLeftZone.top - 1;
+      request++;
+      numRequests++;
+   }
+
+   for (request = &requests[firstRequest]; request < &requests[firstRequest + numRequests]; request++)
+   {
+      request->readPixels = isLinearLight;
+   }
+
+   return numRequests;
+}
+
+// Reduces the crop region from the strips captured for the current frame
+BOOL zoneReduction::reduce(const regionRequest *requests)
+{
+   const regionRequest *strips = &requests[firstRequest];
+   unsigned int nH = layout.numHorisontal;
+   unsigned int nV = layout.numVertical;
+   unsigned int zx, zy, strip;
+
+   if (isLinearLight || (strips[0].frame.hDC == NULL))
+   {
+      const zoneAverager &averager = isLinearLight ? gLinearLightAverager : gSrgbAverager;
+
+      for (zy = 0; zy < nV; zy++)
+      {
+         for (zx = 0; zx < nH; zx++)
+         {
+            screenEdge zone;
+
+            // Inner zones are not used by any LED, skip straight to the right border
+            if ((zy != 0) && (zy != nV - 1) && (zx != 0) && (zx != nH - 1))
+            {
+               zx = nH - 2;
+               continue;
+            }
+
+            // Strips are bottom, top, left, right
+            if (zy == 0)
+               strip = 0;
+            else if (zy == nV - 1)
+               strip = 1;
+            else if (zx == 0)
+               strip = 2;
+            else
+               strip = 3;
+
+            getZoneArea(zx, zy, &zone);
+            averager.average(strips[strip].frame.getAreaPixels(zone), strips[strip].frame.stride,
+               zone.right - zone.left + 1, zone.bottom - zone.top + 1, &lpPixels[(zy * nH + zx) * NUM_VALUES_PER_WIN_PIXEL]);
+         }
+      }
+
+      return TRUE;
+   }
+
+   // GDI frames - stretch every strip into its line of zones (DC lines are top-down)
+   SetStretchBltMode(hDC, HALFTONE);
+   for (strip = 0; strip < numRequests; strip++)
+   {
+      int destX = 0, destY = 0, destWidth = nH, destHeight = 1;
+
+      if (strip == 0)
+      {
+         destY = nV - 1;
+      }
+      else if (strip >= 2)
+      {
+         destX = (strip == 2) ? 0 : (nH - 1);
+         destY = 1;
+         destWidth = 1;
+         destHeight = nV - 2;
+      }
+
+      if (!StretchBlt(hDC, destX, destY, destWidth, destHeight, strips[strip].frame.hDC, 0, 0, strips[strip].frame.width(), strips[strip].frame.height(), SRCCOPY))
+      {
+         printf("Error!!! StretchBlt failed\n");
+         return FALSE;
+      }
+   }
+
+#ifdef SAVE_BITMAP_TO_CLIPBOARD
+   // save bitmap to clipboard
+   OpenClipboard(NULL);
+   EmptyClipboard();
+   SetClipboardData(CF_BITMAP, hBitmap);
+   CloseClipboard();
+#endif // SAVE_BITMAP_TO_CLIPBOARD
+
+   // store the actual bitmap data (the "pixels") in the buffer lpPixels
+   if (0 == GetDIBits(hDC, hBitmap, 0, layout.numVertical, lpPixels, &bmInfo, DIB_RGB_COLORS))
+   {
+      printf("Error!!! GetDIBits failed\n");
+      return FALSE;
+   }
+
+   return TRUE;
+}
+
+// Returns TRUE when the statistics were printed
+BOOL captureStats::addFrame(long long captureTime, long long reduceTime, unsigned long long frameCapturedBytes, unsigned long long frameFullBytes)
+{
+   numFrames++;
+   captureUsec += captureTime;
+   reduceUsec += reduceTime;
+   capturedBytes += frameCapturedBytes;
+   fullFrameBytes += frameFullBytes;
+
+   auto elapsed = std::chrono::high_resolution_clock::now() - intervalStart;
+   long long elapsedUsec = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+
+   if ((numFrames < gStatsIntervalFrames) && (elapsedUsec < (long long)gStatsIntervalMaxSec * SEC_TO_MSEC * MSEC_TO_USEC))
+      return FALSE;
+
+   printf("Stats: %.1f fps, capture %lld [uSec], reduce %lld [uSec] (%.1f%% of capture), captured %llu [KB/frame] (%.1f%% of full frame)\n",
+      (double)numFrames * MSEC_TO_USEC * SEC_TO_MSEC / elapsedUsec,
+      captureUsec / numFrames, reduceUsec / numFrames,
+      (captureUsec > 0) ? (100.0 * reduceUsec / captureUsec) : 0.0,
+      capturedBytes / numFrames / 1024,
+      (fullFrameBytes > 0) ? (100.0 * capturedBytes / fullFrameBytes) : 0.0);
+
+   reset();
+   return TRUE;
+}
+
+captureRateController::captureRateController(unsigned int numBytes, BOOL isSelfPaced)
+{
+   unsigned int i;
+
+   this->numBytes = numBytes;
+   this->isSelfPaced = isSelfPaced;
+   prevLeds = new BYTE[numBytes];
+   memset(prevLeds, 0, numBytes);
+   isChanged = FALSE;
+   isBlack = FALSE;
+   mode = CAPTURE_RATE_ACTIVE;
+   lastChange = std::chrono::high_resolution_clock::now();
+   lastNotBlack = lastChange;
+   frameStart = lastChange;
+
+   intervalStart = lastChange;
+   for (i = 0; i < CAPTURE_RATE_NUM_MODES; i++)
+      modeUsec[i] = 0;
+   numFrames = 0;
+   intervalCpuTime = getThreadCpuTime();
+}
+
+captureRateController::~captureRateController()
+{
+   delete[] prevLeds;
+}
+
+// User and kernel time of the calling thread, in 100 nSec units
+ULONGLONG captureRateController::getThreadCpuTime()
+{
+   FILETIME creationTime, exitTime, kernelTime, userTime;
+
+   if (!GetThreadTimes(GetCurrentThread(), &creationTime, &exitTime, &kernelTime, &userTime))
+      return 0;
+
+   return (((ULONGLONG)kernelTime.dwHighDateTime << 32) | kernelTime.dwLowDateTime)
+      + (((ULONGLONG)userTime.dwHighDateTime << 32) | userTime.dwLowDateTime);
+}
+
+unsigned int captureRateController::getModeFps(captureRateMode mode)
+{
+   switch (mode)
+   {
+   case CAPTURE_RATE_STATIC:
+      return gCaptureFpsStatic;
+   case CAPTURE_RATE_IDLE:
+      return gCaptureFpsIdle;
+   default:
+      return gCaptureFpsActive;
+   }
+}
+
+const char* captureRateController::getModeName(captureRateMode mode)
+{
+   switch (mode)
+   {
+   case CAPTURE_RATE_STATIC:
+      return "static";
+   case CAPTURE_RATE_IDLE:
+      return "idle";
+   default:
+      return "active";
+   }
+}
+
+void captureRateController::beginFrame()
+{
+   frameStart = std::chrono::high_resolution_clock::now();
+   isChanged = FALSE;
+   isBlack = TRUE;
+}
+
+void captureRateController::addLeds(unsigned int offset, const BYTE* leds, unsigned int numLedBytes)
+{
+   unsigned int i;
+
+   if (offset + numLedBytes > numBytes)
+      return;
+
+   for (i = 0; i < numLedBytes; i++)
+   {
+      BYTE prev = prevLeds[offset + i];
+      unsigned int diff = (leds[i] > prev) ? (leds[i] - prev) : (prev - leds[i]);
+
+      if (diff > gStaticColorThreshold)
+         isChanged = TRUE;
+      if (leds[i] > gBlackColorThreshold)
+         isBlack = FALSE;
+   }
+
+   memcpy(&prevLeds[offset], leds, numLedBytes);
+}
+
+void captureRateController::endFrame()
+{
+   captureRateMode prevMode = mode;
+   auto now = std::chrono::high_resolution_clock::now();
+
+   // Time spent in the previous mode, up to the start of this frame
+   modeUsec[mode] += std::chrono::duration_cast<std::chrono::microseconds>(now - intervalStart).count();
+   intervalStart = now;
+   numFrames++;
+
+   if (!isBlack)
+      lastNotBlack = now;
+
+   if (isChanged)
+   {
+      // Back to the full rate right away, from the next frame on
+      lastChange = now;
+      mode = CAPTURE_RATE_ACTIVE;
+   }
+   else
+   {
+      long long staticMsec = std::chrono::duration_cast<std::chrono::milliseconds>(now - lastChange).count();
+      long long blackMsec = std::chrono::duration_cast<std::chrono::milliseconds>(now - lastNotBlack).count();
+
+      if ((staticMsec >= gIdleDelayMsec) || (blackMsec >= gStaticDelayMsec))
+         mode = CAPTURE_RATE_IDLE;
+      else if (staticMsec >= gStaticDelayMsec)
+         mode = CAPTURE_RATE_STATIC;
+      else
+         mode = CAPTURE_RATE_ACTIVE;
+   }
+
+   if (!adaptiveCaptureRate_enable || isSelfPaced)
+      mode = CAPTURE_RATE_ACTIVE;
+
+   if (mode != prevMode)
+      printf("Capture rate: %s (%d fps)\n", getModeName(mode), getModeFps(mode));
+}
+
+DWORD captureRateController::getWaitMsec() const
+{
+   if (!adaptiveCaptureRate_enable || isSelfPaced)
+      return 1; // Just yield the thread
+
+   long long frameUsec = MSEC_TO_USEC * SEC_TO_MSEC / getModeFps(mode);
+   long long elapsedUsec = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - frameStart).count();
+
+   if (elapsedUsec + MSEC_TO_USEC >= frameUsec)
+      return 1;
+
+   return (DWORD)((frameUsec - elapsedUsec) / MSEC_TO_USEC);
+}
+
+// Time spent in each mode and the capture thread CPU load, compared to capturing every frame at the full rate
+void captureRateController::printStats()
+{
+   unsigned int i;
+   long long totalUsec = 0;
+   ULONGLONG cpuTime = getThreadCpuTime();
+   double cpuUsec = (double)(cpuTime - intervalCpuTime) / 10;
+
+   modeUsec[mode] += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - intervalStart).count();
+   intervalStart = std::chrono::high_resolution_clock::now();
+
+   for (i = 0; i < CAPTURE_RATE_NUM_MODES; i++)
+      totalUsec += modeUsec[i];
+
+   if ((totalUsec > 0) && (numFrames > 0))
+   {
+      double cpuLoad = 100.0 * cpuUsec / totalUsec;
+      double fullRateCpuLoad = 100.0 * (cpuUsec / numFrames) * gCaptureFpsActive / (MSEC_TO_USEC * SEC_TO_MSEC);
+
+      printf("   Capture rate: active %.0f%%, static %.0f%%, idle %.0f%% of the time, capture thread CPU %.1f%% (%.1f%% at full rate, %.0f%% saved)\n",
+         100.0 * modeUsec[CAPTURE_RATE_ACTIVE] / totalUsec, 100.0 * modeUsec[CAPTURE_RATE_STATIC] / totalUsec, 100.0 * modeUsec[CAPTURE_RATE_IDLE] / totalUsec,
+         cpuLoad, fullRateCpuLoad, (fullRateCpuLoad > cpuLoad) ? (100.0 * (fullRateCpuLoad - cpuLoad) / fullRateCpuLoad) : 0.0);
+   }
+
+   for (i = 0; i < CAPTURE_RATE_NUM_MODES; i++)
+      modeUsec[i] = 0;
+   numFrames = 0;
+   intervalCpuTime = cpuTime;
+}
+
+ledRecorder::ledRecorder(const char *fileName, unsigned int maxNumBytes)
+{
+   unsigned int i;
+
+   this->fileName = fileName;
+   this->maxNumBytes = maxNumBytes;
+   hFile = INVALID_HANDLE_VALUE;
+   hWriterThread = NULL;
+   hFrameEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+   numFramesAdded = 0;
+   numFramesWritten = 0;
+   numDroppedFrames = 0;
+   isStopping = FALSE;
+
+   for (i = 0; i < numSlots; i++)
+   {
+      slots[i].pixels = new BYTE[maxNumBytes];
+      slots[i].numBytes = 0;
+   }
+
+   for (i = 0; i < gNumLedDevices; i++)
+   {
+      prevFrames[i] = new BYTE[maxNumBytes];
+      framesSinceKeyFrame[i] = keyFrameInterval; // The first frame of every device is a key frame
+   }
+
+   // A delta is written only if it is smaller than the frame
+   payload = new BYTE[maxNumBytes];
+   writeBufferSize = 64 * 1024;
+   writeBuffer = new BYTE[writeBufferSize];
+   writeBufferUsed = 0;
+   numBytesWritten = 0;
+}
+
+ledRecorder::~ledRecorder()
+{
+   unsigned int i;
+
+   stop();
+   CloseHandle(hFrameEvent);
+
+   for (i = 0; i < numSlots; i++)
+      delete[] slots[i].pixels;
+   for (i = 0; i < gNumLedDevices; i++)
+      delete[] prevFrames[i];
+   delete[] payload;
+   delete[] writeBuffer;
+}
+
+BOOL ledRecorder::start()
+{
+   ledRecordingFileHeader fileHeader;
+   DWORD dwThreadId;
+
+   hFile = CreateFileA(fileName, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+   if (hFile == INVALID_HANDLE_VALUE)
+   {
+      printf("Error!!! LED recording: can't create %s\n", fileName);
+      return FALSE;
+   }
+
+   fileHeader.magic = LED_RECORDING_MAGIC;
+   fileHeader.version = LED_RECORDING_VERSION;
+   write(&fileHeader, sizeof(fileHeader));
+
+   startTime = std::chrono::high_resolution_clock::now();
+   hWriterThread = CreateThread(NULL, 0, writerThread, this, 0, &dwThreadId);
+   if (hWriterThread == NULL)
+   {
+      printf("Error!!! LED recording: writer thread failed, error: %d\n", GetLastError());
+      CloseHandle(hFile);
+      hFile = INVALID_HANDLE_VALUE;
+      return FALSE;
+   }
+
+   printf("LED recording: %s\n", fileName);
+   return TRUE;
+}
+
+// Writes the frames that are still queued and closes the file
+void ledRecorder::stop()
+{
+   if (hWriterThread != NULL)
+   {
+      isStopping = TRUE;
+      SetEvent(hFrameEvent);
+      WaitForSingleObject(hWriterThread, INFINITE);
+      CloseHandle(hWriterThread);
+      hWriterThread = NULL;
+   }
+
+   if (hFile != INVALID_HANDLE_VALUE)
+   {
+      flush();
+      CloseHandle(hFile);
+      hFile = INVALID_HANDLE_VALUE;
+
+      printf("LED recording: %lld frames, %llu [KB], %d frames dropped\n", numFramesWritten, numBytesWritten / 1024, numDroppedFrames);
+   }
+}
+
+// Called from the capture thread, never waits for the writer
+void ledRecorder::addFrame(unsigned int deviceIndex, const ledLayout &layout, const BYTE* pixels, unsigned int numBytes)
+{
+   if ((hWriterThread == NULL) || (deviceIndex >= gNumLedDevices) || (numBytes > maxNumBytes))
+      return;
+
+   if (numFramesAdded - numFramesWritten >= numSlots)
+   {
+      InterlockedIncrement(&numDroppedFrames);
+      return;
+   }
+
+   recordingSlot &slot = slots[numFramesAdded % numSlots];
+   slot.timeUsec = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - startTime).count();
+   slot.deviceIndex = deviceIndex;
+   slot.numHorisontal = layout.numHorisontal;
+   slot.numVertical = layout.numVertical;
+   slot.numBytes = numBytes;
+   memcpy(slot.pixels, pixels, numBytes);
+
+   InterlockedIncrement64(&numFramesAdded);
+   SetEvent(hFrameEvent);
+}
+
+DWORD WINAPI ledRecorder::writerThread(LPVOID lpParam)
+{
+   ((ledRecorder*)lpParam)->writerLoop();
+   return 0;
+}
+
+void ledRecorder::writerLoop()
+{
+   while (TRUE)
+   {
+      BOOL isLast = isStopping;
+
+      while (numFramesWritten < numFramesAdded)
+      {
+         writeFrame(slots[numFramesWritten % numSlots]);
+         InterlockedIncrement64(&numFramesWritten);
+      }
+
+      // Nothing is queued - a good time to hand the buffered frames to the file
+      flush();
+
+      if (isLast)
+         break;
+
+      WaitForSingleObject(hFrameEvent, 500);
+   }
+}
+
+void ledRecorder::writeFrame(const recordingSlot &slot)
+{
+   ledRecordingFrameHeader frameHeader;
+   BYTE* prevFrame = prevFrames[slot.deviceIndex];
+   unsigned int payloadSize = 0;
+
+   frameHeader.timeUsec = slot.timeUsec;
+   frameHeader.deviceIndex = (UINT16)slot.deviceIndex;
+   frameHeader.numHorisontal = (UINT16)slot.numHorisontal;
+   frameHeader.numVertical = (UINT16)slot.numVertical;
+   frameHeader.numBytes = slot.numBytes;
+   frameHeader.flags = 0;
+
+   if (framesSinceKeyFrame[slot.deviceIndex] < keyFrameInterval)
+   {
+      payloadSize = encodeDelta(slot.pixels, prevFrame, slot.numBytes, payload);
+   }
+
+   if ((payloadSize == 0) || (payloadSize >= slot.numBytes))
+   {
+      // Key frame, either on the interval or when the delta is not smaller than the frame
+      frameHeader.flags = LED_RECORDING_KEY_FRAME;
+      frameHeader.payloadSize = slot.numBytes;
+      framesSinceKeyFrame[slot.deviceIndex] = 0;
+
+      write(&frameHeader, sizeof(frameHeader));
+      write(slot.pixels, slot.numBytes);
+   }
+   else
+   {
+      frameHeader.payloadSize = payloadSize;
+      framesSinceKeyFrame[slot.deviceIndex]++;
+
+      write(&frameHeader, sizeof(frameHeader));
+      write(payload, payloadSize);
+   }
+
+   memcpy(prevFrame, slot.pixels, slot.numBytes);
+}
+
+BOOL ledRecorder::write(const void* data, unsigned int size)
+{
+   if ((writeBufferUsed + size > writeBufferSize) && !flush())
+      return FALSE;
+
+   if (size > writeBufferSize)
+   {
+      DWORD bytesWritten;
+      numBytesWritten += size;
+      return WriteFile(hFile, data, size, &bytesWritten, NULL);
+   }
+
+   memcpy(&writeBuffer[writeBufferUsed], data, size);
+   writeBufferUsed += size;
+   numBytesWritten += size;
+   return TRUE;
+}
+
+BOOL ledRecorder::flush()
+{
+   DWORD bytesWritten;
+   BOOL bRet = TRUE;
+
+   if (writeBufferUsed > 0)
+   {
+      bRet = WriteFile(hFile, writeBuffer, writeBufferUsed, &bytesWritten, NULL) && (bytesWritten == writeBufferUsed);
+      if (!bRet)
+         printf("Error!!! LED recording: write failed, error: %d\n", GetLastError());
+      writeBufferUsed = 0;
+   }
+
+   return bRet;
+}
+
+// Returns the payload size, an unchanged frame has an empty payload (a frame header only).
+// Stops at numBytes of payload - the caller writes a key frame instead.
+unsigned int ledRecorder::encodeDelta(const BYTE* frame, const BYTE* prevFrame, unsigned int numBytes, BYTE* payload)
+{
+   unsigned int i = 0, payloadSize = 0;
+
+   while (i < numBytes)
+   {
+      unsigned int numSame = 0, numChanged = 0;
+
+      while ((i < numBytes) && (frame[i] == prevFrame[i]) && (numSame < MAXBYTE))
+      {
+         numSame++;
+         i++;
+      }
+
+      while ((i + numChanged < numBytes) && (frame[i + numChanged] != prevFrame[i + numChanged]) && (numChanged < MAXBYTE))
+         numChanged++;
+
+      if ((i == numBytes) && (numChanged == 0))
+         break; // The rest of the frame is unchanged
+
+      if (payloadSize + 2 + numChanged >= numBytes)
+         return numBytes;
+
+      payload[payloadSize++] = (BYTE)numSame;
+      payload[payloadSize++] = (BYTE)numChanged;
+      memcpy(&payload[payloadSize], &frame[i], numChanged);
+      payloadSize += numChanged;
+      i += numChanged;
+   }
+
+   // An empty delta must not be mistaken for "no delta", it is encoded as a single empty run
+   if (payloadSize == 0)
+   {
+      payload[payloadSize++] = 0;
+      payload[payloadSize++] = 0;
+   }
+
+   return payloadSize;
+}
+
+// Applies a delta payload to the previous frame, in place
+BOOL ledRecorder::decodeDelta(const BYTE* payload, unsigned int payloadSize, BYTE* frame, unsigned int numBytes)
+{
+   unsigned int pos = 0, i = 0;
+
+   while (pos + 2 <= payloadSize)
+   {
+      unsigned int numSame = payload[pos++];
+      unsigned int numChanged = payload[pos++];
+
+      i += numSame;
+      if ((i + numChanged > numBytes) || (pos + numChanged > payloadSize))
+         return FALSE;
+
+      memcpy(&frame[i], &payload[pos], numChanged);
+      pos += numChanged;
+      i += numChanged;
+   }
+
+   return (pos == payloadSize);
+}
+
+BOOL isAnyLedDeviceConnected()
+{
+   unsigned int i;
+
+   for (i = 0; i < gNumLedDevices; i++)
+   {
+      if (gLedDevices[i]->isConnected())
+         return TRUE;
+   }
+
+   return FALSE;
+}
+
+void clearAllLeds()
+{
+   unsigned int i;
+
+   for (i = 0; i < gNumLedDevices; i++)
+   {
+      gLedDevices[i]->clearLeds();
+   }
+}
+
+void captureLoop()
+{
+   unsigned int i, j;
+
+   if (!gFrameSource->open())
+   {
+      // Nothing to capture from (yet), the capture thread will try again
+      return;
+   }
+
+   // Devices with the same layout and crop region share a single reduction
+   zoneReduction* reductions[gNumLedDevices];
+   zoneReduction* deviceReduction[gNumLedDevices];
+   fixedLedKernelFunc deviceKernel[gNumLedDevices];
+   unsigned int numReductions = 0;
+   unsigned int maxNumBytesToSend = 0;
+   unsigned int deviceLedOffset[gNumLedDevices];
+   unsigned int totalNumLedBytes = 0;
+
+   for (i = 0; i < gNumLedDevices; i++)
+   {
+      deviceLedOffset[i] = totalNumLedBytes;
+      deviceKernel[i] = getFixedLedKernel(gLedDevices[i]->layout);
+      totalNumLedBytes += gLedDevices[i]->layout.totalNumBytesToSend();
+
+      deviceReduction[i] = NULL;
+      for (j = 0; j < numReductions; j++)
+      {
+         if (reductions[j]->isSameAs(gLedDevices[i]->getConfig()))
+         {
+            deviceReduction[i] = reductions[j];
+            break;
+         }
+      }
+
+      if (deviceReduction[i] == NULL)
+      {
+         deviceReduction[i] = new zoneReduction(gLedDevices[i]->getConfig());
+         reductions[numReductions++] = deviceReduction[i];
       }
-      else
+
+      if (gLedDevices[i]->layout.totalNumBytesToSend() > maxNumBytesToSend)
+         maxNumBytesToSend = gLedDevices[i]->layout.totalNumBytesToSend();
+   }
+
+   BYTE* finalPixals = new BYTE[maxNumBytesToSend];
+
+   // Border strips of all reductions and the edge probes, captured together from a single frame
+   regionRequest requests[frameSource::maxNumRegions];
+   captureStats stats;
+   captureRateController rate(totalNumLedBytes, gFrameSource->isSelfPaced());
+   auto lastEdgeCheck = std::chrono::high_resolution_clock::now() - std::chrono::seconds(gEdgeDetectionCheckIntervalSec);
+
+   while (!gExitProgram)
+   {
+      unsigned int numRequests = 0;
+      unsigned int firstProbe = 0;
+      BOOL isCheckDue = FALSE;
+      BOOL isEdgeCheck = FALSE;
+
+      if (!isAnyLedDeviceConnected())
+      {
+         //Exit to outer loop and wait there for leds to reconnect
+         break;
+      }
+
+      // Check the resolution and the edges every gEdgeDetectionCheckIntervalSec
+      auto frameStart = std::chrono::high_resolution_clock::now();
+      rate.beginFrame();
+      if (frameStart - lastEdgeCheck >= std::chrono::seconds(gEdgeDetectionCheckIntervalSec))
+      {
+         unsigned int width, height;
+
+         // The check is done once a frame was captured and reduced, a skipped frame leaves it due
+         isCheckDue = TRUE;
+         gFrameSource->getResolution(&width, &height);
+         if (gScreen.res.update(width, height) || !edgeDetection_enable)
+         {
+            gScreen.setDefaultEdges();
+         }
+
+         isEdgeCheck = edgeDetection_enable;
+      }
+
+      screenEdge screenArea = gScreen.curEdges;
+      if ((screenArea.top >= gScreen.res.height) || (screenArea.bottom >= gScreen.res.height) || (screenArea.top >= screenArea.bottom)
+         || (screenArea.right >= gScreen.res.width) || (screenArea.left > gScreen.res.width) || (screenArea.left >= screenArea.right))
+      {
+         printf("Error!!! wrong edges...\n");
+
+         clearAllLeds();
+         gExitProgram = TRUE;
+         break;
+      }
+
+      // Request only the border strips of the reductions that are actually in use
+      for (j = 0; j < numReductions; j++)
+         reductions[j]->isNeeded = FALSE;
+      for (i = 0; i < gNumLedDevices; i++)
+      {
+         if (gLedDevices[i]->isConnected())
+            deviceReduction[i]->isNeeded = TRUE;
+      }
+
+      for (j = 0; j < numReductions; j++)
+      {
+         if (reductions[j]->isNeeded)
+            numRequests += reductions[j]->addRegionRequests(screenArea, requests, numRequests);
+      }
+
+      if (numRequests == 0)
+      {
+         // All devices got disconnected in the meantime
+         Sleep(rate.getWaitMsec());
+         continue;
+      }
+
+      if (isEdgeCheck)
+      {
+         screenEdge probeAreas[screen::numEdgeProbes];
+
+         gScreen.getEdgeProbeAreas(probeAreas);
+         firstProbe = numRequests;
+         for (i = 0; i < screen::numEdgeProbes; i++)
+         {
+            requests[numRequests].area = probeAreas[i];
+            requests[numRequests].readPixels = TRUE;
+            numRequests++;
+         }
+      }
+
+      captureResult captureRes = gFrameSource->captureRegions(requests, numRequests);
+      if (captureRes == CAPTURE_SKIP_FRAME)
+      {
+         // The frame may have changed (e.g. a restarted producer), check the resolution and the edges with the next one
+         lastEdgeCheck = frameStart - std::chrono::seconds(gEdgeDetectionCheckIntervalSec);
+         Sleep(rate.getWaitMsec());
+         continue;
+      }
+      else if (captureRes != CAPTURE_OK)
+      {
+         clearAllLeds();
+         gExitProgram = TRUE;
+         break;
+      }
+      auto captureEnd = std::chrono::high_resolution_clock::now();
+
+      BOOL bRet = TRUE;
+      for (j = 0; (j < numReductions) && bRet; j++)
+      {
+         if (reductions[j]->isNeeded)
+            bRet = reductions[j]->reduce(requests);
+      }
+
+      if (!bRet)
+      {
+         clearAllLeds();
+         gExitProgram = TRUE;
+         break;
+      }
+
+      if (!gFrameSource->isFrameStillValid())
+      {
+         // The producer has overwritten the frame while it was reduced, use the next one
+         Sleep(rate.getWaitMsec());
+         continue;
+      }
+
+      // New edges are used starting from the next frame
+      if (isCheckDue)
+      {
+         if (isEdgeCheck)
+         {
+            gScreen.detectEdges(&requests[firstProbe]);
+         }
+
+         lastEdgeCheck = frameStart;
+      }
+
+      // prepare all LED colors, every device with its own brightness
+      for (i = 0; i < gNumLedDevices; i++)
+      {
+         if (!gLedDevices[i]->isConnected())
+            continue;
+
+         if (deviceKernel[i] != NULL)
+            deviceKernel[i](finalPixals, deviceReduction[i]->lpPixels, gLedDevices[i]->getBrightnessCoef());
+         else
+            prepareLedColors(finalPixals, deviceReduction[i]->lpPixels, gLedDevices[i]->layout, gLedDevices[i]->getBrightnessCoef());
+         gLedDevices[i]->setLeds(finalPixals, gLedDevices[i]->layout.totalNumBytesToSend());
+         rate.addLeds(deviceLedOffset[i], finalPixals, gLedDevices[i]->layout.totalNumBytesToSend());
+      }
+      rate.endFrame();
+      auto reduceEnd = std::chrono::high_resolution_clock::now();
+
+      if (stats.addFrame(std::chrono::duration_cast<std::chrono::microseconds>(captureEnd - frameStart).count(),
+                         std::chrono::duration_cast<std::chrono::microseconds>(reduceEnd - captureEnd).count(),
+                         gFrameSource->takeNumCapturedBytes(),
+                         (unsigned long long)gScreen.res.width * gScreen.res.height * NUM_VALUES_PER_WIN_PIXEL))
+      {
+         for (i = 0; i < gNumLedDevices; i++)
+            gLedDevices[i]->printStats();
+         rate.printStats();
+      }
+
+      // Wait for the next frame of the current capture rate, at least 1mSec to yield the thread
+      Sleep(rate.getWaitMsec());
+   }
+
+   printf("Capture loop is finished...\n");
+
+   // clean up
+   delete[] finalPixals;
+   for (j = 0; j < numReductions; j++)
+      delete reductions[j];
+   gFrameSource->close();
+
+   clearAllLeds();
+}
+
+// Measures the cost of the linear-light reduction against the border strips capture it depends on
+void runLinearLightBenchmark(unsigned int numIterations)
+{
+   gdiFrameSource source;
+   zoneReduction reduction(&gLedDeviceConfigs[0]);
+   regionRequest requests[zoneReduction::maxNumRequests];
+   long long captureUsec = 0, reduceUsec = 0;
+   unsigned long long capturedBytes = 0;
+   unsigned int i, numRequests;
+
+   reduction.isLinearLight = TRUE;
+   gScreen.setDefaultEdges();
+   printf("Linear-light benchmark: %dx%d screen, %dx%d zones, %d iterations\n", gScreen.res.width, gScreen.res.height, reduction.layout.numHorisontal, reduction.layout.numVertical, numIterations);
+
+   for (i = 0; (i < numIterations) && source.open(); i++)
+   {
+      auto start = std::chrono::high_resolution_clock::now();
+      numRequests = reduction.addRegionRequests(gScreen.curEdges, requests, 0);
+      if (source.captureRegions(requests, numRequests) != CAPTURE_OK)
+      {
+         break;
+      }
+      auto captureEnd = std::chrono::high_resolution_clock::now();
+
+      reduction.reduce(requests);
+      auto reduceEnd = std::chrono::high_resolution_clock::now();
+
+      captureUsec += std::chrono::duration_cast<std::chrono::microseconds>(captureEnd - start).count();
+      reduceUsec += std::chrono::duration_cast<std::chrono::microseconds>(reduceEnd - captureEnd).count();
+   }
+   capturedBytes = source.takeNumCapturedBytes();
+
+   if (i > 0)
+   {
+      printf("Capture: %lld [uSec/frame] (%llu [KB/frame]), linear-light reduce: %lld [uSec/frame] (%.1f%% of capture)\n",
+         captureUsec / i, capturedBytes / i / 1024, reduceUsec / i, (captureUsec > 0) ? (100.0 * reduceUsec / captureUsec) : 0.0);
+   }
+}
+
+// Compares the specialized LED kernel of the first device layout with the runtime prepareLedColors()
+void runLedKernelBenchmark(unsigned int numIterations)
+{
+   const ledLayout layout(gLedDeviceConfigs[0].numHorisontal, gLedDeviceConfigs[0].numVertical);
+   fixedLedKernelFunc kernel = getFixedLedKernel(layout);
+   unsigned int zoneBytes = layout.numHorisontal * layout.numVertical * NUM_VALUES_PER_WIN_PIXEL;
+   BYTE* zonePixels = new BYTE[zoneBytes];
+   BYTE* runtimeLeds = new BYTE[layout.totalNumBytesToSend()];
+   BYTE* fixedLeds = new BYTE[layout.totalNumBytesToSend()];
+   const float bCoef = 0.9f;
+   unsigned int i;
+
+   printf("LED kernel benchmark: %dx%d layout, %d LEDs, %d iterations\n", layout.numHorisontal, layout.numVertical, layout.totalAmountOfLeds(), numIterations);
+   if (kernel == NULL)
+   {
+      printf("Error!!! no specialized kernel for %dx%d, add it to gFixedLedKernels\n", layout.numHorisontal, layout.numVertical);
+      delete[] zonePixels;
+      delete[] runtimeLeds;
+      delete[] fixedLeds;
+      return;
+   }
+
+   srand(1);
+   for (i = 0; i < zoneBytes; i++)
+      zonePixels[i] = (BYTE)rand();
+
+   auto start = std::chrono::high_resolution_clock::now();
+   for (i = 0; i < numIterations; i++)
+   {
+      zonePixels[0] = (BYTE)i; // Keeps the calls from being merged
+      prepareLedColors(runtimeLeds, zonePixels, layout, bCoef);
+   }
+   auto runtimeEnd = std::chrono::high_resolution_clock::now();
+
+   for (i = 0; i < numIterations; i++)
+   {
+      zonePixels[0] = (BYTE)i;
+      kernel(fixedLeds, zonePixels, bCoef);
+   }
+   auto fixedEnd = std::chrono::high_resolution_clock::now();
+
+   long long runtimeNsec = std::chrono::duration_cast<std::chrono::nanoseconds>(runtimeEnd - start).count();
+   long long fixedNsec = std::chrono::duration_cast<std::chrono::nanoseconds>(fixedEnd - runtimeEnd).count();
+
+   printf("Runtime layout: %.1f [nSec/frame], specialized: %.1f [nSec/frame] (%.2fx), output %s\n",
+      (double)runtimeNsec / numIterations, (double)fixedNsec / numIterations,
+      (fixedNsec > 0) ? ((double)runtimeNsec / fixedNsec) : 0.0,
+      (memcmp(runtimeLeds, fixedLeds, layout.totalNumBytesToSend()) == 0) ? "identical" : "DIFFERENT");
+
+   delete[] zonePixels;
+   delete[] runtimeLeds;
+   delete[] fixedLeds;
+}
+
+void leds::runLedTest()
+{
+   sendSolidColor(255, 0, 0);
+   Sleep(250);
+   sendSolidColor(0, 255, 0);
+   Sleep(250);
+   sendSolidColor(0, 0, 255);
+   Sleep(250);
+   sendSolidColor(0, 0, 0);
+   Sleep(250);
+}
+
+BOOL CtrlHandler(DWORD fdwCtrlType)
+{
+   gExitProgram = TRUE;
+   return TRUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// Thread routines
+///////////////////////////////////////////////////////////////////////////////////
+
+DWORD WINAPI captureThread(LPVOID lpParam)
+{
+   printf("main capture thread started\n");
+
+   while (!gExitProgram)
+   {
+      Sleep(100);
+
+      if (isAnyLedDeviceConnected())
+      {
+         captureLoop();
+      }
+   }
+
+   return 0;
+}
+
+// Streams a recording into the LED devices, in a loop until the program exits (soak testing).
+// Every frame goes to the device it was recorded from, if that device still has the same layout.
+void runLedReplay(const char *fileName, BOOL isMaxSpeed)
+{
+   ledRecordingFileHeader fileHeader;
+   ledRecordingFrameHeader frameHeader;
+   BYTE* frames[gNumLedDevices];
+   BYTE* payload;
+   unsigned int maxNumBytes = 0;
+   unsigned int i;
+   DWORD bytesRead;
+
+   HANDLE hFile = CreateFileA(fileName, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+   if (hFile == INVALID_HANDLE_VALUE)
+   {
+      printf("Error!!! LED replay: can't open %s\n", fileName);
+      gExitProgram = TRUE;
+      return;
+   }
+
+   if (!ReadFile(hFile, &fileHeader, sizeof(fileHeader), &bytesRead, NULL) || (bytesRead != sizeof(fileHeader))
+      || (fileHeader.magic != LED_RECORDING_MAGIC) || (fileHeader.version != LED_RECORDING_VERSION))
+   {
+      printf("Error!!! LED replay: %s is not a LED recording\n", fileName);
+      CloseHandle(hFile);
+      gExitProgram = TRUE;
+      return;
+   }
+
+   for (i = 0; i < gNumLedDevices; i++)
+   {
+      if (gLedDevices[i]->layout.totalNumBytesToSend() > maxNumBytes)
+         maxNumBytes = gLedDevices[i]->layout.totalNumBytesToSend();
+   }
+   for (i = 0; i < gNumLedDevices; i++)
+   {
+      frames[i] = new BYTE[maxNumBytes];
+      memset(frames[i], 0, maxNumBytes);
+   }
+   payload = new BYTE[maxNumBytes];
+
+   printf("LED replay: %s, %s\n", fileName, isMaxSpeed ? "max speed" : "original speed");
+
+   while (!gExitProgram && isAnyLedDeviceConnected())
+   {
+      unsigned int numFrames = 0, numSkippedFrames = 0, numDisconnectedFrames = 0;
+      auto passStart = std::chrono::high_resolution_clock::now();
+
+      while (!gExitProgram)
+      {
+         if (!ReadFile(hFile, &frameHeader, sizeof(frameHeader), &bytesRead, NULL) || (bytesRead != sizeof(frameHeader)))
+            break; // End of the recording
+
+         BOOL isValid = (frameHeader.deviceIndex < gNumLedDevices) && (frameHeader.payloadSize <= maxNumBytes)
+            && (gLedDevices[frameHeader.deviceIndex]->layout == ledLayout(frameHeader.numHorisontal, frameHeader.numVertical))
+            && (frameHeader.numBytes <= gLedDevices[frameHeader.deviceIndex]->layout.totalNumBytesToSend());
+
+         if (!isValid)
+         {
+            // Recorded with another device configuration, skip the payload
+            LARGE_INTEGER offset;
+            offset.QuadPart = frameHeader.payloadSize;
+            SetFilePointerEx(hFile, offset, NULL, FILE_CURRENT);
+            numSkippedFrames++;
+            continue;
+         }
+
+         if (!ReadFile(hFile, payload, frameHeader.payloadSize, &bytesRead, NULL) || (bytesRead != frameHeader.payloadSize))
+            break;
+
+         BYTE* frame = frames[frameHeader.deviceIndex];
+         if (frameHeader.flags & LED_RECORDING_KEY_FRAME)
+         {
+            if (frameHeader.payloadSize != frameHeader.numBytes)
+            {
+               printf("Error!!! LED replay: corrupted frame %d\n", numFrames);
+               break;
+            }
+            memcpy(frame, payload, frameHeader.numBytes);
+         }
+         else if (!ledRecorder::decodeDelta(payload, frameHeader.payloadSize, frame, frameHeader.numBytes))
+         {
+            printf("Error!!! LED replay: corrupted frame %d\n", numFrames);
+            break;
+         }
+
+         // A disconnected device never takes its frames, don't let it hold up the other devices
+         if (!gLedDevices[frameHeader.deviceIndex]->isConnected())
+         {
+            numDisconnectedFrames++;
+            continue;
+         }
+
+         if (!isMaxSpeed)
+         {
+            long long elapsedUsec = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - passStart).count();
+            if ((long long)frameHeader.timeUsec > elapsedUsec + MSEC_TO_USEC)
+               Sleep((DWORD)((frameHeader.timeUsec - elapsedUsec) / MSEC_TO_USEC));
+         }
+         else
+         {
+            // Hand over a frame only once the sender took the previous one, so the replay runs at the transport rate
+            gLedDevices[frameHeader.deviceIndex]->waitFrameTaken(500);
+         }
+
+         gLedDevices[frameHeader.deviceIndex]->setLeds(frame, frameHeader.numBytes);
+         numFrames++;
+      }
+
+      long long passUsec = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - passStart).count();
+      printf("LED replay: %d frames in %.1f [Sec] (%.1f fps), %d frames skipped, %d frames of disconnected devices\n", numFrames, (double)passUsec / (MSEC_TO_USEC * SEC_TO_MSEC),
+         (passUsec > 0) ? ((double)numFrames * MSEC_TO_USEC * SEC_TO_MSEC / passUsec) : 0.0, numSkippedFrames, numDisconnectedFrames);
+      for (i = 0; i < gNumLedDevices; i++)
+         gLedDevices[i]->printStats();
+
+      if ((numFrames == 0) && (numDisconnectedFrames == 0))
       {
-         allowFastReconnect = TRUE;
+         printf("Error!!! LED replay: no frame matches the LED devices\n");
+         gExitProgram = TRUE;
+         break;
       }
 
-      Sleep(500);
+      // Start over
+      LARGE_INTEGER offset;
+      offset.QuadPart = sizeof(fileHeader);
+      SetFilePointerEx(hFile, offset, NULL, FILE_BEGIN);
+   }
+
+   for (i = 0; i < gNumLedDevices; i++)
+      delete[] frames[i];
+   delete[] payload;
+   CloseHandle(hFile);
+}
+
+DWORD WINAPI replayThread(LPVOID lpParam)
+{
+   printf("LED replay thread started\n");
+
+   while (!gExitProgram)
+   {
+      Sleep(100);
+
+      if (isAnyLedDeviceConnected())
+      {
+         runLedReplay(gReplayFileName, gReplayMaxSpeed);
+      }
    }
 
    return 0;
@@ -830,7 +3928,73 @@ HANDLE startThread(LPTHREAD_START_ROUTINE threadRoutine)
 
 int main(int argc, char* argv[])
 {
-   HANDLE hThreadSerial, hThreadEdges, hThreadCapture;
+   HANDLE hThreadCapture;
+   unsigned int i;
+   static wchar_t sharedMemoryName[MAX_PATH] = AMBILIGHT_SHARED_FRAME_DEFAULT_NAME;
+   const char* recordingFileName = NULL;
+
+   // "--record <file>" can be added to any other options, take it out before they are parsed
+   for (i = 1; i + 1 < (unsigned int)argc; i++)
+   {
+      if (strcmp(argv[i], "--record") == 0)
+      {
+         recordingFileName = argv[i + 1];
+         for (; i + 2 < (unsigned int)argc; i++)
+            argv[i] = argv[i + 2];
+         argc -= 2;
+         break;
+      }
+   }
+
+   if ((argc > 1) && (strcmp(argv[1], "--bench-linear") == 0))
+   {
+      runLinearLightBenchmark((argc > 2) ? atoi(argv[2]) : 200);
+      return 0;
+   }
+
+   if ((argc > 1) && (strcmp(argv[1], "--bench-kernels") == 0))
+   {
+      runLedKernelBenchmark((argc > 2) ? atoi(argv[2]) : 1000000);
+      return 0;
+   }
+
+   // Select the frame source, the screen is used by default
+   if ((argc > 2) && (strcmp(argv[1], "--replay") == 0))
+   {
+      gReplayFileName = argv[2];
+      gReplayMaxSpeed = (argc > 3) && (strcmp(argv[3], "max") == 0);
+   }
+   else if ((argc > 1) && (strcmp(argv[1], "--shm") == 0))
+   {
+      if (argc > 2)
+      {
+         size_t converted;
+         mbstowcs_s(&converted, sharedMemoryName, MAX_PATH, argv[2], _TRUNCATE);
+      }
+
+      gFrameSource = new sharedMemoryFrameSource(sharedMemoryName);
+   }
+   else if ((argc > 4) && (strcmp(argv[1], "--file") == 0))
+   {
+      gFrameSource = new rawFileFrameSource(argv[2], atoi(argv[3]), atoi(argv[4]), (argc > 5) ? atoi(argv[5]) : 0);
+   }
+   else if ((argc > 2) && (strcmp(argv[1], "--y4m") == 0))
+   {
+      gFrameSource = new yuvFileFrameSource(argv[2], TRUE, 0, 0, YUV_FORMAT_I420, (argc > 3) ? atoi(argv[3]) : -1);
+   }
+   else if ((argc > 5) && (strcmp(argv[1], "--yuv") == 0))
+   {
+      yuvFormat format = (_stricmp(argv[5], "nv12") == 0) ? YUV_FORMAT_NV12 : YUV_FORMAT_I420;
+      gFrameSource = new yuvFileFrameSource(argv[2], FALSE, atoi(argv[3]), atoi(argv[4]), format, (argc > 6) ? atoi(argv[6]) : 0);
+   }
+   else
+   {
+      gFrameSource = new gdiFrameSource();
+   }
+   if (gFrameSource != NULL)
+   {
+      printf("Frame source: %s\n", gFrameSource->getName());
+   }
 
    if (!SetConsoleCtrlHandler((PHANDLER_ROUTINE)CtrlHandler, TRUE))
    {
@@ -838,10 +4002,40 @@ int main(int argc, char* argv[])
       return -1;
    }
 
+   // Create output devices, each device connects and sends from its own thread
+   for (i = 0; i < gNumLedDevices; i++)
+   {
+      gLedDevices[i] = new leds(&gLedDeviceConfigs[i]);
+      gLedDevices[i]->start();
+   }
+
+   // A replay is recorded too, its frames are handed to the devices the same way, but not into the replayed file
+   if ((recordingFileName != NULL) && (gReplayFileName != NULL) && (_stricmp(recordingFileName, gReplayFileName) == 0))
+   {
+      printf("Error!!! LED recording: %s is the replayed file, not recording\n", recordingFileName);
+      recordingFileName = NULL;
+   }
+
+   // Recording starts before the first frame is handed to the devices
+   if (recordingFileName != NULL)
+   {
+      unsigned int maxNumBytes = 0;
+      for (i = 0; i < gNumLedDevices; i++)
+      {
+         if (gLedDevices[i]->layout.totalNumBytesToSend() > maxNumBytes)
+            maxNumBytes = gLedDevices[i]->layout.totalNumBytesToSend();
+      }
+
+      gLedRecorder = new ledRecorder(recordingFileName, maxNumBytes);
+      if (!gLedRecorder->start())
+      {
+         delete gLedRecorder;
+         gLedRecorder = NULL;
+      }
+   }
+
    // Start threads
-   hThreadSerial  = startThread(serialConnectionThread);
-   hThreadEdges   = startThread(detectScreenEdgesThread);
-   hThreadCapture = startThread(captureThread);
+   hThreadCapture = startThread((gReplayFileName != NULL) ? replayThread : captureThread);
 
    // Program termination
    printf("Press any key to terminate...\n");
@@ -853,11 +4047,17 @@ int main(int argc, char* argv[])
    WaitForSingleObject(hThreadCapture, INFINITE);
    CloseHandle(hThreadCapture);
 
-   WaitForSingleObject(hThreadSerial, INFINITE);
-   CloseHandle(hThreadSerial);
+   // No frames are handed to the devices anymore, write what is left of the recording
+   delete gLedRecorder;
+   gLedRecorder = NULL;
+
+   // Stops the sender threads and turns the LEDs off
+   for (i = 0; i < gNumLedDevices; i++)
+   {
+      delete gLedDevices[i];
+   }
 
-   WaitForSingleObject(hThreadEdges, INFINITE);
-   CloseHandle(hThreadEdges);
+   delete gFrameSource;
    
    return 0;
 }
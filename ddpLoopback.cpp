@@ -0,0 +1,416 @@
+// ddpLoopback.cpp : Stand-in for a network LED controller, for testing the UDP (DDP) output on a single Linux machine.
+//
+// Build: g++ -O2 -o ddpLoopback ddpLoopback.cpp
+//
+// ddpLoopback recv [port]                                   - receive DDP frames, report throughput and packet loss
+// ddpLoopback send <host> [port] [numLeds] [fps] [seconds]  - send DDP frames the same way the client does (fps 0 = max speed)
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <sys/time.h>
+
+///////////////////////////////////////////////////////////////////////////////////
+// Defines
+///////////////////////////////////////////////////////////////////////////////////
+
+#define DDP_DEFAULT_PORT (4048)
+#define DDP_HEADER_SIZE (10)
+#define DDP_MAX_DATA_SIZE (1440) // 480 RGB pixels per packet, same as the client
+#define DDP_PACKET_SIZE (DDP_HEADER_SIZE + DDP_MAX_DATA_SIZE)
+
+#define DDP_FLAGS_VER1 (0x40)
+#define DDP_FLAGS_PUSH (0x01)
+#define DDP_TYPE_RGB24 (0x0B)
+#define DDP_ID_DISPLAY (0x01)
+
+#define MAX_PACKETS_PER_BATCH (64)
+#define SEC_TO_USEC (1000000)
+
+///////////////////////////////////////////////////////////////////////////////////
+// Globals
+///////////////////////////////////////////////////////////////////////////////////
+
+volatile sig_atomic_t gExitProgram = 0;
+
+///////////////////////////////////////////////////////////////////////////////////
+// Classes
+///////////////////////////////////////////////////////////////////////////////////
+
+class ddpReceiverStats {
+public:
+   unsigned long long numPackets;
+   unsigned long long numBytes;
+   unsigned long long numFrames;
+   unsigned long long numLostFrames;       // Detected by gaps in the sequence numbers
+   unsigned long long numIncompleteFrames; // Frames with a missing packet
+   unsigned long long numBadPackets;
+
+   ddpReceiverStats() { reset(); }
+
+   void reset() {
+      numPackets = 0;
+      numBytes = 0;
+      numFrames = 0;
+      numLostFrames = 0;
+      numIncompleteFrames = 0;
+      numBadPackets = 0;
+   }
+
+   void add(const ddpReceiverStats &other) {
+      numPackets += other.numPackets;
+      numBytes += other.numBytes;
+      numFrames += other.numFrames;
+      numLostFrames += other.numLostFrames;
+      numIncompleteFrames += other.numIncompleteFrames;
+      numBadPackets += other.numBadPackets;
+   }
+
+   void print(const char *title, double seconds) {
+      unsigned long long numExpected = numFrames + numLostFrames;
+
+      printf("%s: %.0f fps, %.0f packets/s, %.1f Mbit/s, %llu lost frames, %llu incomplete frames, %llu bad packets (%.3f%% loss)\n",
+         title, numFrames / seconds, numPackets / seconds, numBytes * 8 / seconds / 1000000,
+         numLostFrames, numIncompleteFrames, numBadPackets,
+         (numExpected > 0) ? (100.0 * (numLostFrames + numIncompleteFrames) / numExpected) : 0.0);
+   }
+};
+
+// Follows the packets of a frame the way a controller does: packets of a frame share a sequence number,
+// their data offsets are consecutive and the last one carries the push flag.
+class ddpFrameTracker {
+private:
+   unsigned int curSequence;
+   unsigned int expectedOffset;
+   bool isFrameBroken;
+
+public:
+   ddpFrameTracker() {
+      curSequence = 0;
+      expectedOffset = 0;
+      isFrameBroken = false;
+   }
+
+   void onPacket(const unsigned char *packet, unsigned int size, ddpReceiverStats *stats);
+};
+
+///////////////////////////////////////////////////////////////////////////////////
+// Functions
+///////////////////////////////////////////////////////////////////////////////////
+
+void ddpFrameTracker::onPacket(const unsigned char *packet, unsigned int size, ddpReceiverStats *stats)
+{
+   unsigned int sequence, offset, dataSize;
+   bool isPush;
+
+   if ((size < DDP_HEADER_SIZE) || ((packet[0] & 0xC0) != DDP_FLAGS_VER1))
+   {
+      stats->numBadPackets++;
+      return;
+   }
+
+   sequence = packet[1] & 0x0F;
+   offset = ((unsigned int)packet[4] << 24) | ((unsigned int)packet[5] << 16) | ((unsigned int)packet[6] << 8) | packet[7];
+   dataSize = ((unsigned int)packet[8] << 8) | packet[9];
+   isPush = (packet[0] & DDP_FLAGS_PUSH) != 0;
+
+   if (dataSize != size - DDP_HEADER_SIZE)
+   {
+      stats->numBadPackets++;
+      return;
+   }
+
+   stats->numPackets++;
+   stats->numBytes += size;
+
+   if (sequence != curSequence)
+   {
+      // A new frame started before the previous one was pushed
+      if (expectedOffset != 0)
+      {
+         stats->numIncompleteFrames++;
+      }
+
+      // Sequence numbers run 1..15, count the frames that were skipped entirely
+      if ((curSequence != 0) && (sequence != 0))
+      {
+         unsigned int gap = (sequence + 15 - curSequence) % 15;
+         if (gap > 1)
+            stats->numLostFrames += gap - 1;
+      }
+
+      curSequence = sequence;
+      expectedOffset = 0;
+      isFrameBroken = false;
+   }
+
+   if (offset != expectedOffset)
+   {
+      isFrameBroken = true;
+   }
+   expectedOffset = offset + dataSize;
+
+   if (isPush)
+   {
+      if (isFrameBroken)
+         stats->numIncompleteFrames++;
+      else
+         stats->numFrames++;
+
+      expectedOffset = 0;
+      isFrameBroken = false;
+   }
+}
+
+long long nowUsec()
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (long long)ts.tv_sec * SEC_TO_USEC + ts.tv_nsec / 1000;
+}
+
+void signalHandler(int)
+{
+   gExitProgram = 1;
+}
+
+int openSocket(const char *host, unsigned int port, bool isReceiver)
+{
+   struct addrinfo hints;
+   struct addrinfo *addr = NULL;
+   char portString[8];
+   int sock;
+
+   memset(&hints, 0, sizeof(hints));
+   hints.ai_family = AF_INET;
+   hints.ai_socktype = SOCK_DGRAM;
+   hints.ai_flags = isReceiver ? AI_PASSIVE : 0;
+   snprintf(portString, sizeof(portString), "%u", port);
+
+   if ((getaddrinfo(host, portString, &hints, &addr) != 0) || (addr == NULL))
+   {
+      printf("Error!!! can't resolve %s:%u\n", host ? host : "*", port);
+      return -1;
+   }
+
+   sock = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+   if (sock < 0)
+   {
+      printf("Error!!! socket failed\n");
+      freeaddrinfo(addr);
+      return -1;
+   }
+
+   if ((isReceiver ? bind(sock, addr->ai_addr, addr->ai_addrlen) : connect(sock, addr->ai_addr, addr->ai_addrlen)) != 0)
+   {
+      printf("Error!!! %s failed\n", isReceiver ? "bind" : "connect");
+      freeaddrinfo(addr);
+      close(sock);
+      return -1;
+   }
+   freeaddrinfo(addr);
+
+   // Bigger socket buffers, bursts at max speed would otherwise be dropped by the kernel and not by the "network"
+   int bufferSize = 8 * 1024 * 1024;
+   setsockopt(sock, SOL_SOCKET, isReceiver ? SO_RCVBUF : SO_SNDBUF, &bufferSize, sizeof(bufferSize));
+
+   return sock;
+}
+
+int runReceiver(unsigned int port)
+{
+   // All buffers are allocated once, recvmmsg() fills up to MAX_PACKETS_PER_BATCH packets per call
+   static unsigned char packets[MAX_PACKETS_PER_BATCH][DDP_PACKET_SIZE];
+   struct mmsghdr msgs[MAX_PACKETS_PER_BATCH];
+   struct iovec iovecs[MAX_PACKETS_PER_BATCH];
+   ddpFrameTracker tracker;
+   ddpReceiverStats intervalStats, totalStats;
+   struct timeval timeout = { 0, 100 * 1000 };
+   int i, sock, numReceived;
+
+   sock = openSocket(NULL, port, true);
+   if (sock < 0)
+      return -1;
+
+   // recvmmsg() only checks its own timeout after a packet arrived, a socket timeout keeps the loop (and the stats) going
+   setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+   memset(msgs, 0, sizeof(msgs));
+   for (i = 0; i < MAX_PACKETS_PER_BATCH; i++)
+   {
+      iovecs[i].iov_base = packets[i];
+      iovecs[i].iov_len = DDP_PACKET_SIZE;
+      msgs[i].msg_hdr.msg_iov = &iovecs[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+   }
+
+   printf("Receiving DDP on port %u, press Ctrl-C to stop...\n", port);
+
+   long long startTime = nowUsec();
+   long long intervalStart = startTime;
+
+   while (!gExitProgram)
+   {
+      numReceived = recvmmsg(sock, msgs, MAX_PACKETS_PER_BATCH, MSG_WAITFORONE, NULL);
+
+      for (i = 0; i < numReceived; i++)
+      {
+         tracker.onPacket(packets[i], msgs[i].msg_len, &intervalStats);
+      }
+
+      long long now = nowUsec();
+      if (now - intervalStart >= SEC_TO_USEC)
+      {
+         if (intervalStats.numPackets > 0)
+            intervalStats.print("Interval", (double)(now - intervalStart) / SEC_TO_USEC);
+
+         totalStats.add(intervalStats);
+         intervalStats.reset();
+         intervalStart = now;
+      }
+   }
+
+   totalStats.add(intervalStats);
+   totalStats.print("Total", (double)(nowUsec() - startTime) / SEC_TO_USEC);
+
+   close(sock);
+   return 0;
+}
+
+int runSender(const char *host, unsigned int port, unsigned int numLeds, unsigned int fps, unsigned int seconds)
+{
+   unsigned int numBytes = numLeds * 3;
+   unsigned int numPackets = (numBytes + DDP_MAX_DATA_SIZE - 1) / DDP_MAX_DATA_SIZE;
+   unsigned char *packetBuffer = new unsigned char[numPackets * DDP_PACKET_SIZE];
+   struct mmsghdr *msgs = new struct mmsghdr[numPackets];
+   struct iovec *iovecs = new struct iovec[numPackets];
+   unsigned long long numFrames = 0, numSendErrors = 0;
+   unsigned int i, sequence = 0;
+   int sock;
+
+   sock = openSocket(host, port, false);
+   if (sock < 0)
+      return -1;
+
+   // Headers are built once, only the sequence number and the pixel data change between frames
+   memset(msgs, 0, numPackets * sizeof(struct mmsghdr));
+   for (i = 0; i < numPackets; i++)
+   {
+      unsigned char *packet = &packetBuffer[i * DDP_PACKET_SIZE];
+      unsigned int offset = i * DDP_MAX_DATA_SIZE;
+      unsigned int dataSize = ((numBytes - offset) < DDP_MAX_DATA_SIZE) ? (numBytes - offset) : DDP_MAX_DATA_SIZE;
+
+      packet[0] = DDP_FLAGS_VER1 | ((i == numPackets - 1) ? DDP_FLAGS_PUSH : 0);
+      packet[2] = DDP_TYPE_RGB24;
+      packet[3] = DDP_ID_DISPLAY;
+      packet[4] = (unsigned char)(offset >> 24);
+      packet[5] = (unsigned char)(offset >> 16);
+      packet[6] = (unsigned char)(offset >> 8);
+      packet[7] = (unsigned char)(offset);
+      packet[8] = (unsigned char)(dataSize >> 8);
+      packet[9] = (unsigned char)(dataSize);
+
+      iovecs[i].iov_base = packet;
+      iovecs[i].iov_len = DDP_HEADER_SIZE + dataSize;
+      msgs[i].msg_hdr.msg_iov = &iovecs[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+   }
+
+   printf("Sending %u LEDs (%u packets per frame) to %s:%u at %s for %u [Sec]\n", numLeds, numPackets, host, port, fps ? "fixed rate" : "max speed", seconds);
+
+   long long startTime = nowUsec();
+   long long endTime = startTime + (long long)seconds * SEC_TO_USEC;
+   long long frameInterval = fps ? (SEC_TO_USEC / fps) : 0;
+   long long nextFrame = startTime;
+
+   while (!gExitProgram)
+   {
+      long long now = nowUsec();
+      if (now >= endTime)
+         break;
+
+      if (frameInterval && (now < nextFrame))
+      {
+         usleep(nextFrame - now);
+         continue;
+      }
+      nextFrame += frameInterval;
+
+      // A moving gradient, so the payload changes every frame
+      sequence = (sequence % 15) + 1;
+      for (i = 0; i < numPackets; i++)
+      {
+         unsigned char *packet = &packetBuffer[i * DDP_PACKET_SIZE];
+         unsigned int j, dataSize = iovecs[i].iov_len - DDP_HEADER_SIZE;
+
+         packet[1] = (unsigned char)sequence;
+         for (j = 0; j < dataSize; j++)
+            packet[DDP_HEADER_SIZE + j] = (unsigned char)(numFrames + i * DDP_MAX_DATA_SIZE + j);
+      }
+
+      // All packets of a frame in a single system call
+      unsigned int numSent = 0;
+      while (numSent < numPackets)
+      {
+         int res = sendmmsg(sock, &msgs[numSent], numPackets - numSent, 0);
+         if (res <= 0)
+         {
+            numSendErrors++;
+            break;
+         }
+         numSent += res;
+      }
+
+      numFrames++;
+   }
+
+   double elapsed = (double)(nowUsec() - startTime) / SEC_TO_USEC;
+   printf("Sent %llu frames (%.0f fps, %.0f packets/s), %llu send errors\n", numFrames, numFrames / elapsed, numFrames * numPackets / elapsed, numSendErrors);
+
+   close(sock);
+   delete[] packetBuffer;
+   delete[] msgs;
+   delete[] iovecs;
+   return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// Entry-point
+///////////////////////////////////////////////////////////////////////////////////
+
+int main(int argc, char* argv[])
+{
+   // No SA_RESTART, so Ctrl-C interrupts a blocking receive
+   struct sigaction action;
+   memset(&action, 0, sizeof(action));
+   action.sa_handler = signalHandler;
+   sigaction(SIGINT, &action, NULL);
+   sigaction(SIGTERM, &action, NULL);
+
+   if ((argc > 1) && (strcmp(argv[1], "recv") == 0))
+   {
+      return runReceiver((argc > 2) ? atoi(argv[2]) : DDP_DEFAULT_PORT);
+   }
+
+   if ((argc > 2) && (strcmp(argv[1], "send") == 0))
+   {
+      return runSender(argv[2],
+         (argc > 3) ? atoi(argv[3]) : DDP_DEFAULT_PORT,
+         (argc > 4) ? atoi(argv[4]) : 88,
+         (argc > 5) ? atoi(argv[5]) : 0,
+         (argc > 6) ? atoi(argv[6]) : 5);
+   }
+
+   printf("Usage:\n");
+   printf("   %s recv [port]\n", argv[0]);
+   printf("   %s send <host> [port] [numLeds] [fps] [seconds]\n", argv[0]);
+   return -1;
+}